@@ -0,0 +1,154 @@
+// -*- C++ -*-
+
+/**
+ * @file   addressset.h
+ * @brief  A set of addresses, kept in a hash table that never calls malloc.
+ */
+
+#ifndef _ADDRESSSET_H_
+#define _ADDRESSSET_H_
+
+#include <stdlib.h>
+
+#include "mmapwrapper.h"
+
+/**
+ * @class AddressSet
+ * @brief An open-addressing (linear probing) hash set of non-NULL pointers.
+ *
+ * The table is mapped directly (it may live inside the allocator), and
+ * doubles when half full. Removal shifts later entries back rather
+ * than leaving tombstones, so lookups stay short. Not thread-safe.
+ */
+
+class AddressSet {
+public:
+
+  AddressSet (void)
+    : _table (NULL),
+      _capacity (0),
+      _count (0)
+  {}
+
+  /// @return true iff ptr is now in the set (false if out of memory).
+  bool insert (void * ptr) {
+    if ((2 * (_count + 1) > _capacity) && !grow()) {
+      return false;
+    }
+    size_t i = find (ptr);
+    if (_table[i] == NULL) {
+      _table[i] = ptr;
+      _count++;
+    }
+    return true;
+  }
+
+  /// @return true iff ptr was in the set (and now is not).
+  bool remove (void * ptr) {
+    if (_count == 0) {
+      return false;
+    }
+    size_t i = find (ptr);
+    if (_table[i] == NULL) {
+      return false;
+    }
+    _table[i] = NULL;
+    _count--;
+    // Move back any entry that can no longer be reached past the hole.
+    size_t j = i;
+    while (true) {
+      j = (j + 1) & (_capacity - 1);
+      if (_table[j] == NULL) {
+	break;
+      }
+      size_t home = hash (_table[j]);
+      // Does home lie cyclically in (i, j]? Then the entry stays put.
+      bool reachable = (i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j));
+      if (!reachable) {
+	_table[i] = _table[j];
+	_table[j] = NULL;
+	i = j;
+      }
+    }
+    return true;
+  }
+
+  /// @return the number of addresses in the set.
+  inline size_t size (void) const {
+    return _count;
+  }
+
+  /// @return the number of slots, for iterating with at().
+  inline size_t capacity (void) const {
+    return _capacity;
+  }
+
+  /// @return the address in slot i, or NULL if the slot is empty.
+  inline void * at (size_t i) const {
+    return _table[i];
+  }
+
+  /// @brief Empties the set and unmaps the table.
+  void clear (void) {
+    if (_table != NULL) {
+      MmapWrapper::unmap (_table, _capacity * sizeof(void *));
+    }
+    _table = NULL;
+    _capacity = 0;
+    _count = 0;
+  }
+
+private:
+
+  enum { MIN_CAPACITY = 512 };
+
+  inline size_t hash (void * ptr) const {
+    // Objects are page-aligned, so skip the low bits, then mix.
+    size_t v = (size_t) ptr >> 12;
+    v *= (size_t) 0x9E3779B97F4A7C15ULL;
+    return (v >> 16) & (_capacity - 1);
+  }
+
+  /// @return the slot holding ptr, or the empty slot where it would go.
+  inline size_t find (void * ptr) const {
+    size_t i = hash (ptr);
+    while ((_table[i] != NULL) && (_table[i] != ptr)) {
+      i = (i + 1) & (_capacity - 1);
+    }
+    return i;
+  }
+
+  /// @brief Doubles the table, rehashing every entry.
+  bool grow (void) {
+    size_t newCapacity = (_capacity == 0) ? (size_t) MIN_CAPACITY : 2 * _capacity;
+    void ** newTable = (void **) MmapWrapper::map (newCapacity * sizeof(void *));
+    if (newTable == NULL) {
+      return false;
+    }
+    void ** oldTable = _table;
+    size_t oldCapacity = _capacity;
+    _table = newTable;
+    _capacity = newCapacity;
+    for (size_t i = 0; i < oldCapacity; i++) {
+      if (oldTable[i] != NULL) {
+	_table[find (oldTable[i])] = oldTable[i];
+      }
+    }
+    if (oldTable != NULL) {
+      MmapWrapper::unmap (oldTable, oldCapacity * sizeof(void *));
+    }
+    return true;
+  }
+
+  /// The slots (NULL if empty).
+  void ** _table;
+
+  /// The number of slots (a power of two, or 0).
+  size_t _capacity;
+
+  /// The number of occupied slots.
+  size_t _count;
+
+};
+
+#endif
@@ -24,6 +24,20 @@ public:
     return SuperHeap::malloc (sz);
   }
  
+  inline void * calloc (size_t sz) {
+    if (sz < sizeof(double)) {
+      sz = sizeof(double);
+    }
+    return SuperHeap::calloc (sz);
+  }
+
+  inline size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    if (sz < sizeof(double)) {
+      sz = sizeof(double);
+    }
+    return SuperHeap::mallocBatch (sz, n, ptrs);
+  }
+
   inline bool free (void * ptr) {
     if (ptr != 0) {
       return SuperHeap::free (ptr);
@@ -32,6 +46,27 @@ public:
     }
   }
 
+  /// @brief Frees an object, given the size it was requested with.
+  inline bool freeSized (void * ptr, size_t sz) {
+    if (ptr != 0) {
+      // Match the size malloc actually asked for.
+      if (sz < sizeof(double)) {
+	sz = sizeof(double);
+      }
+      return SuperHeap::freeSized (ptr, sz);
+    } else {
+      return true;
+    }
+  }
+
+  /// @return the usable size of an object that memalign (alignment, sz) would give.
+  inline size_t roundSize (size_t alignment, size_t sz) {
+    if (sz < sizeof(double)) {
+      sz = sizeof(double);
+    }
+    return SuperHeap::roundSize (alignment, sz);
+  }
+
   inline size_t getSize (void * ptr) {
     if (ptr) {
       return SuperHeap::getSize (ptr);
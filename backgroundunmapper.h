@@ -0,0 +1,254 @@
+// -*- C++ -*-
+
+/**
+ * @file   backgroundunmapper.h
+ * @brief  Batches munmap calls onto a background thread.
+ */
+
+#ifndef _BACKGROUNDUNMAPPER_H_
+#define _BACKGROUNDUNMAPPER_H_
+
+#include <stdlib.h>
+
+#include "mmapwrapper.h"
+#include "platformspecific.h"
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+/**
+ * @class BackgroundUnmapper
+ * @brief Queues ranges to unmap, and unmaps them in batches elsewhere.
+ *
+ * munmap takes the address space lock for writing and shoots down TLB
+ * entries on every core running the process; this moves that cost off
+ * the freeing thread. The background thread wakes when a batch has
+ * built up (or after a short period), sorts the batch and merges
+ * adjacent ranges, so it often needs fewer calls than there were frees.
+ *
+ * Callers must make the range unreachable through the heap (e.g., clear
+ * it from their size map) before queueing it; until it is unmapped,
+ * its addresses cannot be handed out again by mmap, so a queued range
+ * never aliases a new object. When the queue is full, or the thread
+ * cannot be started, ranges are unmapped immediately.
+ *
+ * Nothing here calls malloc. unmap runs under the heap's lock, so it
+ * never starts the thread itself (pthread_create may allocate, or take
+ * locks of its own): the first range is unmapped directly, and the
+ * caller starts the thread afterwards, holding no locks, by calling
+ * startIfWanted. A forked child has no background thread, so it starts
+ * its own the same way. Its lock is held across fork by the heap's fork
+ * handlers (see lockAll), after the heap locks, as unmap takes it.
+ */
+
+class BackgroundUnmapper {
+public:
+
+  /// @brief Unmaps the range soon (or now, if it cannot be queued).
+  static void unmap (void * ptr, size_t sz) {
+#if !defined(_WIN32)
+    pthread_mutex_lock (&getLock());
+    if (getThreadState() == NOT_STARTED) {
+      getStartWanted() = true;
+    }
+    int& count = getCount();
+    if ((getThreadState() == RUNNING) && (count < QUEUE_SIZE)) {
+      getQueue()[count].ptr = (char *) ptr;
+      getQueue()[count].sz = sz;
+      count++;
+      if (count == BATCH_SIZE) {
+	pthread_cond_signal (&getWake());
+      }
+      pthread_mutex_unlock (&getLock());
+      return;
+    }
+    pthread_mutex_unlock (&getLock());
+#endif
+    MmapWrapper::unmap (ptr, sz);
+  }
+
+  /// @brief Starts the background thread, if unmap has asked for it.
+  /// @note  Call only while holding no heap lock.
+  static inline void startIfWanted (void) {
+#if !defined(_WIN32)
+    if (getStartWanted()) {
+      startThread();
+    }
+#endif
+  }
+
+  // Hold the lock across fork (called from the heap's fork handlers).
+
+  static void lockAll (void) {
+#if !defined(_WIN32)
+    pthread_mutex_lock (&getLock());
+#endif
+  }
+
+  static void unlockAll (void) {
+#if !defined(_WIN32)
+    pthread_mutex_unlock (&getLock());
+#endif
+  }
+
+  /// @brief In a forked child (instead of unlockAll): the thread is gone,
+  ///        so the next startIfWanted starts another.
+  static void resetInChild (void) {
+#if !defined(_WIN32)
+    if (getThreadState() != NOT_STARTED) {
+      getThreadState() = NOT_STARTED;
+      getStartWanted() = true;
+    }
+    pthread_mutex_unlock (&getLock());
+#endif
+  }
+
+private:
+
+  /// How many ranges can wait, how many make a batch, and how long
+  /// (in milliseconds) a partial batch may wait.
+  enum { QUEUE_SIZE = 256, BATCH_SIZE = 32, PERIOD_MS = 10 };
+
+  enum { NOT_STARTED, STARTING, RUNNING, FAILED };
+
+  struct Range {
+    char * ptr;
+    size_t sz;
+  };
+
+#if !defined(_WIN32)
+
+  NO_INLINE static void startThread (void) {
+    // Claim the start, so only one caller creates the thread.
+    pthread_mutex_lock (&getLock());
+    bool claimed = getStartWanted() && (getThreadState() == NOT_STARTED);
+    getStartWanted() = false;
+    if (claimed) {
+      getThreadState() = STARTING;
+    }
+    pthread_mutex_unlock (&getLock());
+    if (!claimed) {
+      return;
+    }
+    // Create it without the lock: pthread_create may allocate.
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize (&attr, STACK_SIZE);
+    pthread_t thread;
+    bool started = (pthread_create (&thread, &attr, run, NULL) == 0);
+    pthread_attr_destroy (&attr);
+    pthread_mutex_lock (&getLock());
+    // NB: a fork in the meantime leaves the child NOT_STARTED; keep it so.
+    if (getThreadState() == STARTING) {
+      getThreadState() = started ? RUNNING : FAILED;
+    }
+    pthread_mutex_unlock (&getLock());
+  }
+
+  enum { STACK_SIZE = 64 * 1024 };
+
+  static void * run (void *) {
+    Range batch[QUEUE_SIZE];
+    while (true) {
+      int n = takeBatch (batch);
+      sortByAddress (batch, n);
+      // Unmap runs of adjacent ranges with one call each.
+      int i = 0;
+      while (i < n) {
+	char * start = batch[i].ptr;
+	char * end = start + roundUp (batch[i].sz);
+	for (i++; (i < n) && (batch[i].ptr == end); i++) {
+	  end += roundUp (batch[i].sz);
+	}
+	MmapWrapper::unmap (start, end - start);
+      }
+    }
+    return NULL;
+  }
+
+  /// @brief Waits for a full batch (or a period), then empties the queue into batch.
+  static int takeBatch (Range * batch) {
+    pthread_mutex_lock (&getLock());
+    int& count = getCount();
+    while (count < BATCH_SIZE) {
+      if (count == 0) {
+	pthread_cond_wait (&getWake(), &getLock());
+      } else {
+	struct timeval now;
+	gettimeofday (&now, NULL);
+	struct timespec deadline;
+	long nsec = now.tv_usec * 1000L + PERIOD_MS * 1000000L;
+	deadline.tv_sec = now.tv_sec + nsec / 1000000000L;
+	deadline.tv_nsec = nsec % 1000000000L;
+	if (pthread_cond_timedwait (&getWake(), &getLock(), &deadline) == ETIMEDOUT) {
+	  break;
+	}
+      }
+    }
+    int n = count;
+    for (int i = 0; i < n; i++) {
+      batch[i] = getQueue()[i];
+    }
+    count = 0;
+    pthread_mutex_unlock (&getLock());
+    return n;
+  }
+
+  static void sortByAddress (Range * batch, int n) {
+    // Insertion sort: batches are small.
+    for (int i = 1; i < n; i++) {
+      Range r = batch[i];
+      int j = i - 1;
+      while ((j >= 0) && (batch[j].ptr > r.ptr)) {
+	batch[j + 1] = batch[j];
+	j--;
+      }
+      batch[j + 1] = r;
+    }
+  }
+
+  /// @return sz rounded up to whole pages (the extent of its mapping).
+  static inline size_t roundUp (size_t sz) {
+    return (sz + MmapWrapper::Size - 1) & ~((size_t) MmapWrapper::Size - 1);
+  }
+
+  static pthread_mutex_t& getLock (void) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    return lock;
+  }
+
+  static pthread_cond_t& getWake (void) {
+    static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+    return wake;
+  }
+
+  static Range * getQueue (void) {
+    static Range queue[QUEUE_SIZE];
+    return queue;
+  }
+
+  static int& getCount (void) {
+    static int count = 0;
+    return count;
+  }
+
+  static int& getThreadState (void) {
+    static int state = NOT_STARTED;
+    return state;
+  }
+
+  /// True iff unmap found no thread running, and one should be started.
+  static volatile bool& getStartWanted (void) {
+    static volatile bool wanted = false;
+    return wanted;
+  }
+
+#endif
+
+};
+
+#endif
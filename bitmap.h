@@ -106,6 +106,15 @@ private:
     clear();
   }
 
+  /// @brief Gives the bitmap's memory back to Heap.
+  void release (void) {
+    if (_bitarray != NULL) {
+      Heap::freeSized (_bitarray, (size_t) (_elements / WORDBYTES));
+      _bitarray = NULL;
+      _elements = 0;
+    }
+  }
+
   /// Clears out the bitmap array.
   void clear (void) {
     if (_bitarray != NULL) {
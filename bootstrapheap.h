@@ -0,0 +1,190 @@
+// -*- C++ -*-
+
+/**
+ * @file   bootstrapheap.h
+ * @brief  A small, thread-safe arena for allocations made while the real heap is busy.
+ * @sa     reentrantheap.h
+ */
+
+#ifndef _BOOTSTRAPHEAP_H_
+#define _BOOTSTRAPHEAP_H_
+
+#include <assert.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "staticlog.h"
+
+/**
+ * @class BootstrapHeap
+ * @brief Carves power-of-two chunks out of a static buffer, and reuses freed ones.
+ * @param BufferSize  the size of the static buffer.
+ *
+ * Each chunk is preceded by a one-word header holding its size class;
+ * freed chunks go on a per-class free list, so memory handed out
+ * during initialization (e.g., by dlsym) can be recycled.
+ */
+
+template <int BufferSize = 65536>
+class BootstrapHeap {
+public:
+
+  BootstrapHeap (void)
+    : _lock (0),
+      _position (0)
+  {
+    for (int i = 0; i < NUM_CLASSES; i++) {
+      _freeList[i] = NULL;
+    }
+  }
+
+  /// @return a chunk of at least sz bytes, or NULL if the arena is exhausted.
+  inline void * malloc (size_t sz) {
+    int sizeClass = getSizeClass (sz);
+    if (sizeClass >= NUM_CLASSES) {
+      return NULL;
+    }
+    void * ptr;
+    acquire();
+    if (_freeList[sizeClass] != NULL) {
+      ptr = _freeList[sizeClass];
+      _freeList[sizeClass] = *((void **) ptr);
+    } else {
+      size_t chunkSize = sizeof(Header) + getClassSize (sizeClass);
+      if (_position + chunkSize > sizeof(_buffer)) {
+	release();
+	return NULL;
+      }
+      Header * h = (Header *) ((char *) _buffer + _position);
+      h->sizeClass = sizeClass;
+      _position += chunkSize;
+      ptr = (void *) (h + 1);
+    }
+    release();
+    return ptr;
+  }
+
+  /// @brief Puts a chunk back on its free list.
+  /// @note  ptr may point inside the chunk (e.g., from an over-allocating memalign).
+  inline void free (void * ptr) {
+    assert (contains (ptr));
+    ptr = findChunk (ptr);
+    if (ptr == NULL) {
+      return;
+    }
+    int sizeClass = (int) (((Header *) ptr) - 1)->sizeClass;
+    acquire();
+    *((void **) ptr) = _freeList[sizeClass];
+    _freeList[sizeClass] = ptr;
+    release();
+  }
+
+  /// @return the space available from this point in the given chunk.
+  size_t getSize (void * ptr) {
+    assert (contains (ptr));
+    char * chunk = (char *) findChunk (ptr);
+    if (chunk == NULL) {
+      return 0;
+    }
+    int sizeClass = (int) (((Header *) chunk) - 1)->sizeClass;
+    return getClassSize (sizeClass) - ((char *) ptr - chunk);
+  }
+
+  /// @brief Holds the arena's lock (e.g., across fork).
+  inline void lock (void) {
+    acquire();
+  }
+
+  inline void unlock (void) {
+    release();
+  }
+
+  /// @return true iff the pointer lies inside this arena.
+  inline bool contains (void * ptr) const {
+    return ((char *) ptr >= (char *) _buffer)
+      && ((char *) ptr < (char *) _buffer + sizeof(_buffer));
+  }
+
+private:
+
+  /// A chunk header; a union with double keeps chunks double-aligned.
+  union Header {
+    size_t sizeClass;
+    double _align;
+  };
+
+  enum { MIN_SIZE = 16 };
+  enum { NUM_CLASSES = StaticLog<BufferSize>::VALUE - StaticLog<MIN_SIZE>::VALUE };
+
+  /// @return the start of the chunk holding ptr (which may be an
+  ///         interior pointer), or NULL if ptr is in no chunk.
+  void * findChunk (void * ptr) {
+    // Walk the chunk headers. The arena is small and rarely used.
+    size_t offset = (size_t) ptr - (size_t) _buffer;
+    size_t position = 0;
+    acquire();
+    size_t end = _position;
+    release();
+    while (position < end) {
+      Header * h = (Header *) ((char *) _buffer + position);
+      size_t chunkEnd = position + sizeof(Header) + getClassSize ((int) h->sizeClass);
+      if (offset < chunkEnd) {
+	return (offset < position + sizeof(Header)) ? NULL : (void *) (h + 1);
+      }
+      position = chunkEnd;
+    }
+    return NULL;
+  }
+
+  static inline size_t getClassSize (int sizeClass) {
+    return (size_t) MIN_SIZE << sizeClass;
+  }
+
+  /// @return the smallest class holding sz bytes, or NUM_CLASSES if none does.
+  static inline int getSizeClass (size_t sz) {
+    int sizeClass = 0;
+    // NB: stop at NUM_CLASSES, before the shift could overflow.
+    while ((sizeClass < NUM_CLASSES) && (getClassSize (sizeClass) < sz)) {
+      sizeClass++;
+    }
+    return sizeClass;
+  }
+
+  inline void acquire (void) {
+#if defined(_WIN32)
+    while (InterlockedExchange ((long *) &_lock, 1) != 0) {
+      Sleep (0);
+    }
+#else
+    while (__sync_lock_test_and_set (&_lock, 1) != 0) {
+      while (_lock != 0) {}
+    }
+#endif
+  }
+
+  inline void release (void) {
+#if defined(_WIN32)
+    InterlockedExchange ((long *) &_lock, 0);
+#else
+    __sync_lock_release (&_lock);
+#endif
+  }
+
+  /// Protects the free lists and the bump position.
+  volatile long _lock;
+
+  /// The first unused byte of the buffer.
+  size_t _position;
+
+  /// Freed chunks, by size class.
+  void * _freeList[NUM_CLASSES];
+
+  /// The static buffer for chunks.
+  double _buffer[BufferSize / sizeof(double)];
+
+};
+
+#endif
@@ -3,6 +3,8 @@
 #ifndef _COMBINEHEAP_H_
 #define _COMBINEHEAP_H_
 
+#include "lock.h"
+
 template <class SmallHeap,
 	  class BigHeap>
 class CombineHeap {
@@ -18,6 +20,65 @@ public:
     return ptr;
   }
 
+  /// @return an object of sz bytes, all zero.
+  inline void * calloc (size_t sz) {
+    if (sz > SmallHeap::MAX_SIZE) {
+      return _big.calloc (sz);
+    } else {
+      return _small.calloc (sz);
+    }
+  }
+
+  /// @return an object of sz bytes aligned to alignment (a power of two).
+  inline void * memalign (size_t alignment, size_t sz) {
+    // Small objects are aligned to their size class (up to a limit),
+    // so just ask for a class at least as big as the alignment.
+    size_t classSize = (sz < alignment) ? alignment : sz;
+    if ((classSize <= SmallHeap::MAX_SIZE) && (alignment <= SmallHeap::MAX_ALIGNMENT)) {
+      return _small.malloc (classSize);
+    } else {
+      return _big.memalign (alignment, sz);
+    }
+  }
+
+  /// @brief Allocates an object of size class Index (sizeof(double) << Index bytes).
+  template <int Index>
+  inline void * mallocClass (void) {
+    // The test is constant, so only one branch survives.
+    if ((sizeof(double) << Index) > SmallHeap::MAX_SIZE) {
+      return _big.malloc (sizeof(double) << Index);
+    } else {
+      return _small.template mallocClass<Index>();
+    }
+  }
+
+  template <int Index>
+  inline bool freeClass (void * ptr) {
+    if (((sizeof(double) << Index) <= SmallHeap::MAX_SIZE)
+	&& _small.template freeClass<Index> (ptr)) {
+      return true;
+    } else {
+      return _big.free (ptr);
+    }
+  }
+
+  /// @brief Allocates n objects of sz bytes each.
+  /// @return the number allocated; the rest of ptrs is left untouched.
+  inline size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    if (sz > SmallHeap::MAX_SIZE) {
+      size_t i;
+      for (i = 0; i < n; i++) {
+	ptrs[i] = _big.malloc (sz);
+	if (ptrs[i] == NULL) {
+	  break;
+	}
+      }
+      return i;
+    } else {
+      return _small.mallocBatch (sz, n, ptrs);
+    }
+  }
+
   inline bool free (void * ptr) {
     if (_small.free (ptr)) {
       return true;
@@ -26,6 +87,28 @@ public:
     }
   }
 
+  inline bool freeSized (void * ptr, size_t sz) {
+    if ((sz <= SmallHeap::MAX_SIZE) && _small.freeSized (ptr, sz)) {
+      return true;
+    } else {
+      return _big.free (ptr);
+    }
+  }
+
+  /// @brief Frees every non-NULL object in ptrs.
+  inline bool freeBatch (size_t n, void ** ptrs) {
+    if (!_small.freeBatch (n, ptrs)) {
+      // Some were big objects; the small heap still knows its own
+      // (now freed) objects by their slot sizes.
+      for (size_t i = 0; i < n; i++) {
+	if ((ptrs[i] != NULL) && (_small.getSize (ptrs[i]) == 0)) {
+	  _big.free (ptrs[i]);
+	}
+      }
+    }
+    return true;
+  }
+
   inline size_t getSize (void * ptr) {
     size_t sz = _small.getSize (ptr);
     if (sz == 0) {
@@ -34,6 +117,72 @@ public:
     return sz;
   }
 
+  /// @brief Resizes an object without copying it (see LargeHeap::resize).
+  /// @return the (possibly moved) object if it can now hold sz bytes, or NULL.
+  inline void * resize (void * ptr, size_t sz) {
+    if (_small.getSize (ptr) != 0) {
+      return _small.resize (ptr, sz);
+    } else {
+      return _big.resize (ptr, sz);
+    }
+  }
+
+  /// @brief Like resize, but never moves the object.
+  inline bool resizeInPlace (void * ptr, size_t sz) {
+    if (_small.getSize (ptr) != 0) {
+      return _small.resizeInPlace (ptr, sz);
+    } else {
+      return _big.resizeInPlace (ptr, sz);
+    }
+  }
+
+  /// @return the usable size that memalign (alignment, sz) would give
+  ///         (or malloc (sz), for alignment <= sizeof(double)).
+  inline size_t roundSize (size_t alignment, size_t sz) {
+    // Route exactly as malloc and memalign do.
+    if (alignment <= sizeof(double)) {
+      return (sz > SmallHeap::MAX_SIZE) ? _big.roundSize (sz) : _small.roundSize (sz);
+    }
+    size_t classSize = (sz < alignment) ? alignment : sz;
+    if ((classSize <= SmallHeap::MAX_SIZE) && (alignment <= SmallHeap::MAX_ALIGNMENT)) {
+      return _small.roundSize (classSize);
+    } else {
+      return _big.roundSize (sz);
+    }
+  }
+
+  void lockAll (void) {
+    _small.lockAll();
+    _big.lockAll();
+  }
+
+  void unlockAll (void) {
+    _big.unlockAll();
+    _small.unlockAll();
+  }
+
+  /// @brief Gives both heaps fresh random state (e.g., in a forked child).
+  void reseed (void) {
+    _small.reseed();
+    _big.reseed();
+  }
+
+  /// @brief Frees every object in both heaps at once.
+  void releaseAll (void) {
+    _small.releaseAll();
+    _big.releaseAll();
+  }
+
+  /// @brief Sums the lock statistics of both heaps (when each does its own locking).
+  void getLockStatistics (LockStatistics& stats) {
+    LockStatistics bigStats;
+    _small.getLockStatistics (stats);
+    _big.getLockStatistics (bigStats);
+    stats.acquisitions += bigStats.acquisitions;
+    stats.contended += bigStats.contended;
+    stats.waitCycles += bigStats.waitCycles;
+  }
+
 private:
   SmallHeap _small;
   BigHeap _big;
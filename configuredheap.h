@@ -0,0 +1,342 @@
+// -*- C++ -*-
+
+/**
+ * @file   configuredheap.h
+ * @brief  A heap whose parameters are chosen at startup, from a set compiled in advance.
+ * @sa     heapconfig.h
+ */
+
+#ifndef _CONFIGUREDHEAP_H_
+#define _CONFIGUREDHEAP_H_
+
+#include <assert.h>
+#include <new>
+
+#include "combineheap.h"
+#include "diehardheap.h"
+#include "heapconfig.h"
+#include "largeheap.h"
+#include "lock.h"
+#include "lockheap.h"
+#include "mmapwrapper.h"
+
+/**
+ * @class ConfiguredHeapBase
+ * @brief The interface to a heap built with one particular configuration.
+ */
+
+class ConfiguredHeapBase {
+public:
+
+  virtual void * malloc (size_t) = 0;
+  virtual void * calloc (size_t) = 0;
+  virtual void * memalign (size_t, size_t) = 0;
+  virtual size_t mallocBatch (size_t, size_t, void **) = 0;
+  virtual bool free (void *) = 0;
+  virtual bool freeSized (void *, size_t) = 0;
+  virtual bool freeBatch (size_t, void **) = 0;
+  virtual size_t getSize (void *) = 0;
+  virtual void * resize (void *, size_t) = 0;
+  virtual bool resizeInPlace (void *, size_t) = 0;
+  virtual size_t roundSize (size_t, size_t) = 0;
+  virtual void lockAll (void) = 0;
+  virtual void unlockAll (void) = 0;
+  virtual void reseed (void) = 0;
+  virtual void getLockStatistics (LockStatistics&) = 0;
+
+protected:
+
+  virtual ~ConfiguredHeapBase () {}
+
+};
+
+
+/**
+ * @class ConfiguredHeapImpl
+ * @brief Adapts Heap to ConfiguredHeapBase.
+ */
+
+template <class Heap>
+class ConfiguredHeapImpl : public ConfiguredHeapBase {
+public:
+
+  void * malloc (size_t sz) {
+    return _heap.malloc (sz);
+  }
+
+  void * calloc (size_t sz) {
+    return _heap.calloc (sz);
+  }
+
+  void * memalign (size_t alignment, size_t sz) {
+    return _heap.memalign (alignment, sz);
+  }
+
+  size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    return _heap.mallocBatch (sz, n, ptrs);
+  }
+
+  bool free (void * ptr) {
+    return _heap.free (ptr);
+  }
+
+  bool freeSized (void * ptr, size_t sz) {
+    return _heap.freeSized (ptr, sz);
+  }
+
+  bool freeBatch (size_t n, void ** ptrs) {
+    return _heap.freeBatch (n, ptrs);
+  }
+
+  size_t getSize (void * ptr) {
+    return _heap.getSize (ptr);
+  }
+
+  void * resize (void * ptr, size_t sz) {
+    return _heap.resize (ptr, sz);
+  }
+
+  bool resizeInPlace (void * ptr, size_t sz) {
+    return _heap.resizeInPlace (ptr, sz);
+  }
+
+  size_t roundSize (size_t alignment, size_t sz) {
+    return _heap.roundSize (alignment, sz);
+  }
+
+  void lockAll (void) {
+    _heap.lockAll();
+  }
+
+  void unlockAll (void) {
+    _heap.unlockAll();
+  }
+
+  void reseed (void) {
+    _heap.reseed();
+  }
+
+  void getLockStatistics (LockStatistics& stats) {
+    _heap.getLockStatistics (stats);
+  }
+
+private:
+
+  Heap _heap;
+
+};
+
+
+/**
+ * @class DefaultConfiguration
+ * @brief The usual heap stack, for a given multiplier, threshold and DieFast.
+ */
+
+template <int Numerator,
+	  int Denominator,
+	  int MaxSize,
+	  bool DieFast>
+class DefaultConfiguration {
+public:
+  typedef LockHeap<CombineHeap<DieHardHeap<Numerator, Denominator, MaxSize, DieFast>,
+			       LargeHeap> > Type;
+};
+
+
+/**
+ * @class ConfiguredHeap
+ * @brief Builds the heap that HeapConfig asks for, then forwards to it.
+ *
+ * Multipliers and thresholds are template arguments throughout the
+ * heap, so only a fixed set of them is compiled in. A requested
+ * multiplier is rounded up to the next one available (4/3, 2 or 4),
+ * so it never buys less protection than asked for (HeapConfig has
+ * already clamped larger ones to 4), and a threshold below 65536
+ * selects 4096 (objects up to a page), with a warning unless it was
+ * 4096. When any of the variables is set, the heap actually built is
+ * reported on stderr. Each combination is a whole heap's worth of
+ * code, so the set is kept small. The choice is made once, in the
+ * constructor; afterwards every call is one virtual call, with no
+ * further look at the configuration.
+ *
+ * @param Configuration  maps the parameters to a heap type (see DefaultConfiguration).
+ */
+
+template <template <int, int, int, bool> class Configuration>
+class ConfiguredHeap {
+public:
+
+  ConfiguredHeap (void)
+    : _heap (create (HeapConfig::get()))
+  {
+    assert (_heap != NULL);
+  }
+
+  inline void * malloc (size_t sz) {
+    return _heap->malloc (sz);
+  }
+
+  inline void * calloc (size_t sz) {
+    return _heap->calloc (sz);
+  }
+
+  inline void * memalign (size_t alignment, size_t sz) {
+    return _heap->memalign (alignment, sz);
+  }
+
+  /// @note The class is not known at compile time here, so this is a plain malloc.
+  template <int Index>
+  inline void * mallocClass (void) {
+    return _heap->malloc (sizeof(double) << Index);
+  }
+
+  template <int Index>
+  inline bool freeClass (void * ptr) {
+    return _heap->free (ptr);
+  }
+
+  inline size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    return _heap->mallocBatch (sz, n, ptrs);
+  }
+
+  inline bool free (void * ptr) {
+    return _heap->free (ptr);
+  }
+
+  inline bool freeSized (void * ptr, size_t sz) {
+    return _heap->freeSized (ptr, sz);
+  }
+
+  inline bool freeBatch (size_t n, void ** ptrs) {
+    return _heap->freeBatch (n, ptrs);
+  }
+
+  inline size_t getSize (void * ptr) {
+    return _heap->getSize (ptr);
+  }
+
+  inline void * resize (void * ptr, size_t sz) {
+    return _heap->resize (ptr, sz);
+  }
+
+  inline bool resizeInPlace (void * ptr, size_t sz) {
+    return _heap->resizeInPlace (ptr, sz);
+  }
+
+  inline size_t roundSize (size_t alignment, size_t sz) {
+    return _heap->roundSize (alignment, sz);
+  }
+
+  void lockAll (void) {
+    _heap->lockAll();
+  }
+
+  void unlockAll (void) {
+    _heap->unlockAll();
+  }
+
+  void reseed (void) {
+    _heap->reseed();
+  }
+
+  void getLockStatistics (LockStatistics& stats) {
+    _heap->getLockStatistics (stats);
+  }
+
+private:
+
+  static ConfiguredHeapBase * create (const HeapConfig& config) {
+    if (config.dieFast()) {
+      return createWithDieFast<true> (config);
+    } else {
+      return createWithDieFast<false> (config);
+    }
+  }
+
+  template <bool DieFast>
+  static ConfiguredHeapBase * createWithDieFast (const HeapConfig& config) {
+    if (config.multiplierAtMost (4, 3)) {
+      return createWithMultiplier<4, 3, DieFast> (config);
+    } else if (config.multiplierAtMost (2, 1)) {
+      return createWithMultiplier<2, 1, DieFast> (config);
+    } else {
+      return createWithMultiplier<4, 1, DieFast> (config);
+    }
+  }
+
+  template <int Numerator, int Denominator, bool DieFast>
+  static ConfiguredHeapBase * createWithMultiplier (const HeapConfig& config) {
+    if (config.largeThreshold() >= 65536) {
+      return createHeap<Numerator, Denominator, 65536, DieFast>();
+    } else {
+      if (config.largeThreshold() != 4096) {
+	HeapConfig::warn ("DieHard: DIEHARD_LARGE_THRESHOLD is not 4096 or 65536; using 4096\n");
+      }
+      return createHeap<Numerator, Denominator, 4096, DieFast>();
+    }
+  }
+
+  template <int Numerator, int Denominator, int MaxSize, bool DieFast>
+  static ConfiguredHeapBase * createHeap (void) {
+    typedef ConfiguredHeapImpl<typename Configuration<Numerator, Denominator, MaxSize, DieFast>::Type> TheHeap;
+    // Mapped, not allocated: we are inside the first malloc.
+    void * buf = MmapWrapper::map (sizeof(TheHeap));
+    if (buf == NULL) {
+      return NULL;
+    }
+    report (Numerator, Denominator, MaxSize, DieFast);
+    return new (buf) TheHeap;
+  }
+
+  /// @brief Says which heap was built, if the environment asked for one
+  ///        (the choice may differ from the request: see above).
+  static void report (int numerator, int denominator, int maxSize, bool dieFast) {
+    if ((HeapConfig::getVariable ("DIEHARD_M") == NULL)
+	&& (HeapConfig::getVariable ("DIEHARD_DIEFAST") == NULL)
+	&& (HeapConfig::getVariable ("DIEHARD_LARGE_THRESHOLD") == NULL)) {
+      return;
+    }
+    char buf[128];
+    char * p = append (buf, "DieHard: using DIEHARD_M=");
+    p = appendNumber (p, numerator);
+    if (denominator != 1) {
+      p = append (p, "/");
+      p = appendNumber (p, denominator);
+    }
+    p = append (p, " DIEHARD_LARGE_THRESHOLD=");
+    p = appendNumber (p, maxSize);
+    p = append (p, dieFast ? " DIEHARD_DIEFAST=1\n" : " DIEHARD_DIEFAST=0\n");
+    HeapConfig::warn (buf);
+  }
+
+  /// @brief Copies s (with its terminating NUL) to p.
+  /// @return where the next string goes (over that NUL).
+  static char * append (char * p, const char * s) {
+    while ((*p = *s) != '\0') {
+      p++;
+      s++;
+    }
+    return p;
+  }
+
+  /// @brief Writes n (non-negative) in decimal to p, as append does.
+  static char * appendNumber (char * p, int n) {
+    char digits[16];
+    int len = 0;
+    do {
+      digits[len++] = (char) ('0' + n % 10);
+      n /= 10;
+    } while (n > 0);
+    while (len > 0) {
+      *p++ = digits[--len];
+    }
+    *p = '\0';
+    return p;
+  }
+
+  /// The heap, with the parameters chosen at startup.
+  ConfiguredHeapBase * const _heap;
+
+};
+
+#endif
@@ -0,0 +1,43 @@
+// -*- C++ -*-
+
+/**
+ * @file   copyonwrite.h
+ * @brief  Records whether the heap's pages may still be shared with a parent process.
+ */
+
+#ifndef _COPYONWRITE_H_
+#define _COPYONWRITE_H_
+
+/**
+ * @class CopyOnWrite
+ * @brief A process-wide fork generation, advanced in a forked child (with DIEHARD_COW).
+ *
+ * Memory a heap held at the last fork may still be shared with the
+ * parent, so heaps avoid optional writes (e.g., DieFast fills) to it
+ * until it is handed out again; they compare the generation against
+ * the one they last saw to tell inherited memory from their own.
+ */
+
+class CopyOnWrite {
+public:
+
+  /// @return the number of forks (in COW mode) this process descends from.
+  static inline unsigned int getGeneration (void) {
+    return getGenerationCount();
+  }
+
+  /// @brief Starts a new generation: every heap page may now be shared; called after fork.
+  static void forked (void) {
+    getGenerationCount()++;
+  }
+
+private:
+
+  static inline volatile unsigned int& getGenerationCount (void) {
+    static volatile unsigned int generation = 0;
+    return generation;
+  }
+
+};
+
+#endif
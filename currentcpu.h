@@ -0,0 +1,111 @@
+// -*- C++ -*-
+
+/**
+ * @file   currentcpu.h
+ * @brief  Finds the CPU the calling thread is running on, using restartable sequences (rseq).
+ */
+
+#ifndef _CURRENTCPU_H_
+#define _CURRENTCPU_H_
+
+#include <stdlib.h>
+
+#include "platformspecific.h"
+#include "threadexit.h"
+
+#if defined(linux)
+#include <sched.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(SYS_rseq)
+#include <linux/rseq.h>
+
+// Exported by glibc 2.35 and later, which registers rseq for every thread.
+extern "C" {
+  extern const ptrdiff_t __rseq_offset __attribute__ ((weak));
+  extern const unsigned int __rseq_size __attribute__ ((weak));
+}
+#endif
+#endif
+
+/**
+ * @class CurrentCPU
+ * @brief Reads the current CPU from the thread's rseq area.
+ *
+ * The kernel keeps the area up to date, so this costs a load rather
+ * than a system call. Without rseq, we fall back to sched_getcpu().
+ */
+
+class CurrentCPU {
+public:
+
+  /// @return the CPU this thread is running on, or -1 if unknown.
+  static inline int get (void) {
+#if defined(linux)
+#if defined(SYS_rseq)
+    volatile struct rseq * rs = getRseq();
+    if (rs != NULL) {
+      int cpu = (int) rs->cpu_id;
+      if (cpu >= 0) {
+	return cpu;
+      }
+    }
+#endif
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+  }
+
+private:
+
+#if defined(linux) && defined(SYS_rseq)
+
+  /// The signature the kernel expects before abort handlers (unused here).
+  enum { RSEQ_SIGNATURE = 0x53053053 };
+
+  /// @return this thread's rseq area, registering one if need be, or NULL.
+  static inline volatile struct rseq * getRseq (void) {
+    // Prefer glibc's registration, if it made one.
+    if ((&__rseq_size != NULL) && (__rseq_size > 0)) {
+      return (volatile struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+    }
+    int& registered = getRegistered();
+    if (registered == 0) {
+      registered = (syscall (SYS_rseq, &getOwnRseq(), sizeof(struct rseq), 0, RSEQ_SIGNATURE) == 0) ? 1 : -1;
+      if (registered == 1) {
+	// The kernel writes to this area until we unregister it, so
+	// do so before the thread's TLS is released.
+	ThreadExit::atThreadExit (unregisterRseq);
+      }
+    }
+    return (registered == 1) ? &getOwnRseq() : NULL;
+  }
+
+  /// @brief Unregisters this thread's own rseq area, if it has one.
+  static void unregisterRseq (void) {
+    int& registered = getRegistered();
+    if (registered == 1) {
+      syscall (SYS_rseq, &getOwnRseq(), sizeof(struct rseq), RSEQ_FLAG_UNREGISTER, RSEQ_SIGNATURE);
+      // Any later allocation on this thread uses sched_getcpu().
+      registered = -1;
+    }
+  }
+
+  /// @return this thread's registration state: 0 = not yet tried, 1 = ours, -1 = none.
+  static inline int& getRegistered (void) {
+    static INITIAL_EXEC_TLS int registered = 0;
+    return registered;
+  }
+
+  static inline struct rseq& getOwnRseq (void) {
+    static INITIAL_EXEC_TLS struct rseq ownRseq __attribute__ ((aligned (32)));
+    return ownRseq;
+  }
+
+#endif
+
+};
+
+#endif
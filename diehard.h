@@ -8,6 +8,21 @@
 #define DIEHARD_DIEFAST 0
 #endif
 
+// Keeps heap pages shared with the parent after fork (see copyonwrite.h).
+#ifndef DIEHARD_COW
+#define DIEHARD_COW 0
+#endif
+
+// Places mini heaps on the allocating thread's NUMA node (see numaalloc.h).
+#ifndef DIEHARD_NUMA
+#define DIEHARD_NUMA 0
+#endif
+
+// Unmaps freed large objects on a background thread (see backgroundunmapper.h).
+#ifndef DIEHARD_BACKGROUND_UNMAP
+#define DIEHARD_BACKGROUND_UNMAP 0
+#endif
+
 #define DIEHARD_DLL_NAME "C:\\Windows\\System32\\diehard-system.dll"
 #define MADCHOOK_DLL_NAME "C:\\Windows\\System32\\madCHook.dll"
 #define DIEHARD_GUID "D5DCD74D-EDBB-4e96-B9F1-DECF65E5BF92"
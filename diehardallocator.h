@@ -0,0 +1,266 @@
+// -*- C++ -*-
+
+/**
+ * @file   diehardallocator.h
+ * @brief  A C++ allocator (and a std::pmr::memory_resource) that pick DieHard's size class at compile time.
+ * @sa     util/stlallocator.h, diehardapi.h
+ */
+
+#ifndef _DIEHARDALLOCATOR_H_
+#define _DIEHARDALLOCATOR_H_
+
+#include <stddef.h>
+#include <new>
+
+#include "diehardapi.h"
+#include "staticlog.h"
+
+#if (__cplusplus >= 201703L) && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define DIEHARD_HAVE_PMR 1
+#endif
+#endif
+
+#if (__cplusplus >= 201103L)
+#define DIEHARD_ALIGNOF(T) alignof(T)
+#elif defined(__GNUC__)
+#define DIEHARD_ALIGNOF(T) __alignof__(T)
+#elif defined(_MSC_VER)
+#define DIEHARD_ALIGNOF(T) __alignof(T)
+#else
+#define DIEHARD_ALIGNOF(T) sizeof(double)
+#endif
+
+namespace diehard {
+
+  /// The size classes the library provides entry points for: objects
+  /// of sizeof(double) << Index bytes, for Index < NUM_CLASSES.
+  enum { NUM_CLASSES = 14,
+	 MAX_CLASS_SIZE = sizeof(double) << (NUM_CLASSES - 1),
+	 MAX_CLASS_ALIGNMENT = 4096 };
+
+  /// @brief Allocates an object from size class Index, without any
+  ///        run-time size dispatch (defined in wrapper.cpp).
+  template <int Index> void * mallocClass (void);
+
+  /// @brief Frees an object allocated by mallocClass<Index>.
+  template <int Index> void freeClass (void * ptr);
+
+  /**
+   * @class SizeClass
+   * @brief The size class for objects of Size bytes and the given alignment.
+   *
+   * VALUE is NUM_CLASSES if no class fits (the object is too big or
+   * too aligned), in which case callers use the general interface.
+   */
+  template <size_t Size, size_t Alignment>
+  class SizeClass {
+    enum { BYTES = (Size < Alignment) ? Alignment : Size };
+    enum { FITS = (BYTES <= MAX_CLASS_SIZE) && (Alignment <= MAX_CLASS_ALIGNMENT) };
+    // NB: clamp, so the log is only taken of sizes that fit.
+    enum { CLAMPED = (!FITS || (BYTES <= sizeof(double))) ? sizeof(double) : BYTES };
+  public:
+    enum { VALUE = FITS
+	   ? (StaticLog<CLAMPED - 1>::VALUE + 1 - StaticLog<sizeof(double)>::VALUE)
+	   : NUM_CLASSES };
+  };
+
+  /// @return the size class for sz bytes (at run time), or NUM_CLASSES if none.
+  inline int getSizeClass (size_t sz) {
+    if (sz > MAX_CLASS_SIZE) {
+      return NUM_CLASSES;
+    }
+    int index = 0;
+    while ((sizeof(double) << index) < sz) {
+      index++;
+    }
+    return index;
+  }
+
+  /// @brief Allocates from a size class chosen at run time (one jump).
+  inline void * mallocIndex (int index) {
+    switch (index) {
+    case 0:  return mallocClass<0>();
+    case 1:  return mallocClass<1>();
+    case 2:  return mallocClass<2>();
+    case 3:  return mallocClass<3>();
+    case 4:  return mallocClass<4>();
+    case 5:  return mallocClass<5>();
+    case 6:  return mallocClass<6>();
+    case 7:  return mallocClass<7>();
+    case 8:  return mallocClass<8>();
+    case 9:  return mallocClass<9>();
+    case 10: return mallocClass<10>();
+    case 11: return mallocClass<11>();
+    case 12: return mallocClass<12>();
+    case 13: return mallocClass<13>();
+    default: return NULL;
+    }
+  }
+
+  inline void freeIndex (int index, void * ptr) {
+    switch (index) {
+    case 0:  freeClass<0> (ptr); break;
+    case 1:  freeClass<1> (ptr); break;
+    case 2:  freeClass<2> (ptr); break;
+    case 3:  freeClass<3> (ptr); break;
+    case 4:  freeClass<4> (ptr); break;
+    case 5:  freeClass<5> (ptr); break;
+    case 6:  freeClass<6> (ptr); break;
+    case 7:  freeClass<7> (ptr); break;
+    case 8:  freeClass<8> (ptr); break;
+    case 9:  freeClass<9> (ptr); break;
+    case 10: freeClass<10> (ptr); break;
+    case 11: freeClass<11> (ptr); break;
+    case 12: freeClass<12> (ptr); break;
+    case 13: freeClass<13> (ptr); break;
+    default: break;
+    }
+  }
+
+
+  /**
+   * @class allocator
+   * @brief An STL allocator whose single-object requests go straight
+   *        to the RandomHeap for sizeof(T).
+   *
+   * Node-based containers (list, map, set, ...) allocate one node at a
+   * time, so their requests never pass through the general malloc
+   * path's size lookup or heap dispatch. Arrays (n > 1) use mallocx.
+   * All instances are interchangeable.
+   */
+
+  template <class T>
+  class allocator {
+  public:
+
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    typedef T * pointer;
+    typedef const T * const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+
+    template <class U> struct rebind { typedef allocator<U> other; };
+
+    allocator (void) {}
+    allocator (const allocator&) {}
+    template <class U> allocator (const allocator<U>&) {}
+
+    inline pointer allocate (size_type n, const void * = 0) {
+      void * ptr;
+      if ((n == 1) && (CLASS < NUM_CLASSES)) {
+	ptr = mallocClass<CLASS>();
+      } else if (n > max_size()) {
+	throw std::bad_alloc();
+      } else {
+	ptr = CUSTOM_PREFIX(mallocx) (n * sizeof(T), MALLOCX_ALIGN (DIEHARD_ALIGNOF(T)));
+      }
+      if (ptr == NULL) {
+	throw std::bad_alloc();
+      }
+      return (pointer) ptr;
+    }
+
+    inline void deallocate (pointer p, size_type n) {
+      if ((n == 1) && (CLASS < NUM_CLASSES)) {
+	freeClass<CLASS> (p);
+      } else {
+	CUSTOM_PREFIX(sdallocx) (p, n * sizeof(T), MALLOCX_ALIGN (DIEHARD_ALIGNOF(T)));
+      }
+    }
+
+    pointer address (reference x) const { return &x; }
+    const_pointer address (const_reference x) const { return &x; }
+
+    void construct (pointer p, const T& val) { new ((void *) p) T (val); }
+    void destroy (pointer p) { p->~T(); }
+
+    size_type max_size (void) const {
+      return ((size_type) -1) / sizeof(T);
+    }
+
+  private:
+
+    /// The size class for one T (resolved at compile time).
+    enum { CLASS = SizeClass<sizeof(T), DIEHARD_ALIGNOF(T)>::VALUE };
+
+  };
+
+  template <class T, class U>
+  inline bool operator== (const allocator<T>&, const allocator<U>&) {
+    return true;
+  }
+
+  template <class T, class U>
+  inline bool operator!= (const allocator<T>&, const allocator<U>&) {
+    return false;
+  }
+
+
+#if DIEHARD_HAVE_PMR
+
+  /**
+   * @class memory_resource
+   * @brief A std::pmr::memory_resource over DieHard's size classes.
+   *
+   * Requests arrive with a run-time size, so the class is found with
+   * a short loop and reached through one switch; from there, the call
+   * goes directly to that class's RandomHeap, as for allocator<T>.
+   */
+
+  class memory_resource : public std::pmr::memory_resource {
+  protected:
+
+    void * do_allocate (size_t bytes, size_t alignment) override {
+      int index = getClass (bytes, alignment);
+      void * ptr;
+      if (index < NUM_CLASSES) {
+	ptr = mallocIndex (index);
+      } else {
+	ptr = CUSTOM_PREFIX(mallocx) (bytes, MALLOCX_ALIGN (alignment));
+      }
+      if (ptr == NULL) {
+	throw std::bad_alloc();
+      }
+      return ptr;
+    }
+
+    void do_deallocate (void * ptr, size_t bytes, size_t alignment) override {
+      int index = getClass (bytes, alignment);
+      if (index < NUM_CLASSES) {
+	freeIndex (index, ptr);
+      } else {
+	CUSTOM_PREFIX(sdallocx) (ptr, bytes, MALLOCX_ALIGN (alignment));
+      }
+    }
+
+    bool do_is_equal (const std::pmr::memory_resource& other) const noexcept override {
+      // Every instance allocates from the same heap.
+      return (dynamic_cast<const memory_resource *>(&other) != NULL);
+    }
+
+  private:
+
+    static inline int getClass (size_t bytes, size_t alignment) {
+      if (alignment > MAX_CLASS_ALIGNMENT) {
+	return NUM_CLASSES;
+      }
+      return getSizeClass ((bytes < alignment) ? alignment : bytes);
+    }
+
+  };
+
+  /// @return a resource shared by the whole program.
+  inline memory_resource * get_memory_resource (void) {
+    static memory_resource resource;
+    return &resource;
+  }
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,99 @@
+/* -*- C -*- */
+
+/**
+ * @file   diehardapi.h
+ * @brief  DieHard's own entry points, beyond the standard malloc interface.
+ * @sa     wrapper.cpp
+ */
+
+#ifndef _DIEHARDAPI_H_
+#define _DIEHARDAPI_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reports the heap lock's counters (any argument may be NULL). */
+void diehard_lock_statistics (unsigned long long * acquisitions,
+			      unsigned long long * contended,
+			      unsigned long long * waitCycles);
+
+/* Allocates n objects of the given size into ptrs; returns how many. */
+size_t diehard_malloc_batch (size_t size, size_t n, void ** ptrs);
+
+/* Frees n objects (NULLs are skipped). */
+void diehard_free_batch (size_t n, void ** ptrs);
+
+/*
+ * Heap instances: independent heaps, each with its own lock, size
+ * classes and address space. Objects from an instance must be freed
+ * with diehard_heap_free on that instance (not with free), and
+ * destroying an instance frees every object still in it.
+ */
+
+typedef struct diehard_heap diehard_heap_t;
+
+typedef struct diehard_heap_config {
+  /* Nonzero to fill freed objects and check them for overflows (DieFast). */
+  int diefast;
+} diehard_heap_config;
+
+/* Returns a new heap, or NULL. A NULL config selects the build's defaults. */
+diehard_heap_t * diehard_heap_create (const diehard_heap_config * config);
+
+void * diehard_heap_malloc (diehard_heap_t * heap, size_t size);
+
+void diehard_heap_free (diehard_heap_t * heap, void * ptr);
+
+/* Releases all of the heap's memory, in time proportional to its mappings. */
+void diehard_heap_destroy (diehard_heap_t * heap);
+
+/* Returns the heap's index, for MALLOCX_ARENA. */
+unsigned int diehard_heap_arena (diehard_heap_t * heap);
+
+/*
+ * The jemalloc extended interface. Sizes come from the heap's size
+ * classes: nallocx (size, 0) is the usable size of mallocx (size, 0),
+ * and a container may use all of it (MALLOCX_ZERO zeroes all of it,
+ * too). xallocx never moves an object. MALLOCX_ARENA names a heap
+ * instance (see diehard_heap_arena), whose objects must then be freed
+ * with the same flag.
+ *
+ * Like malloc, these are exported under the library's CUSTOM_PREFIX
+ * (see wrapper.cpp): DieHard_mallocx, and so on, unless DieHard
+ * replaces malloc itself.
+ */
+
+#ifndef CUSTOM_PREFIX
+#define CUSTOM_PREFIX(n) DieHard_##n
+#endif
+
+#ifndef MALLOCX_LG_ALIGN
+#define MALLOCX_LG_ALIGN(la)	((int) (la))
+#if defined(__GNUC__)
+#define MALLOCX_ALIGN(a)	((int) __builtin_ctzl ((unsigned long) (a)))
+#else
+#include <strings.h>
+#define MALLOCX_ALIGN(a)	((int) (ffs ((int) (a)) - 1))
+#endif
+#define MALLOCX_ZERO		((int) 0x40)
+/* There are no thread caches; accepted and ignored. */
+#define MALLOCX_TCACHE_NONE	((int) 0x100)
+#define MALLOCX_ARENA(a)	((((int) (a)) + 1) << 20)
+#endif
+
+void * CUSTOM_PREFIX(mallocx) (size_t size, int flags);
+void * CUSTOM_PREFIX(rallocx) (void * ptr, size_t size, int flags);
+size_t CUSTOM_PREFIX(xallocx) (void * ptr, size_t size, size_t extra, int flags);
+size_t CUSTOM_PREFIX(sallocx) (const void * ptr, int flags);
+void CUSTOM_PREFIX(dallocx) (void * ptr, int flags);
+void CUSTOM_PREFIX(sdallocx) (void * ptr, size_t size, int flags);
+size_t CUSTOM_PREFIX(nallocx) (size_t size, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
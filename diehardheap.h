@@ -18,6 +18,7 @@
 #include "diefast.h"
 #include "staticforloop.h"
 #include "log2.h"
+#include "ownershipmap.h"
 #include "platformspecific.h"
 #include "realrandomvalue.h"
 #include "randomheap.h"
@@ -42,20 +43,33 @@ private:
 public:
 
   enum { MAX_SIZE = MaxSize };
+
+  /// Mini heaps start on a page boundary, so every object of size
+  /// 2^k is aligned to 2^k, up to the page size.
+  enum { MAX_ALIGNMENT = MmapWrapper::Size };
   
-  DieHardHeap (void)
-    : _localRandomValue (RealRandomValue::value())
+  /// @param owner  the OwnershipMap tag for this heap's miniheaps.
+  DieHardHeap (unsigned int owner = 0)
+    : _localRandomValue (RealRandomValue::value()),
+      _owner (owner)
   {
     sassert<(sizeof(RandomHeap<Numerator, Denominator, sizeof(double), MaxSize, RandomMiniHeap, DieFast>)
 	     == (sizeof(RandomHeap<Numerator, Denominator, 256 * sizeof(double), MaxSize, RandomMiniHeap, DieFast>)))>
       verifyNoSizeDependencies;
     sassert<((1 << (MAX_INDEX-1)) * sizeof(double)) == MaxSize>
       verifySizeFormulation;
+    sassert<(MAX_INDEX <= MaskingBudget<Numerator, Denominator>::MAX_CLASSES)>
+      verifyBudgetHoldsEveryClass;
     // Statically declare MAX_INDEX heaps, each one containing
     // objects twice as large as the preceding one: the first one
     // holds doubles, then the next holds objects of size
     // 2*sizeof(double), etc. See the Initializer class below.
-    StaticForLoop<0, MAX_INDEX, Initializer, void *>::run ((void *) _buf);
+    // The heaps themselves are only constructed on first use (see
+    // initializeHeap), since most programs touch a few size classes.
+    StaticForLoop<0, MAX_INDEX, Registrar, InitializerFunction **>::run (_initializers);
+    for (int i = 0; i < MAX_INDEX; i++) {
+      _initialized[i] = false;
+    }
   }
   
   /// @brief Allocate an object of the requested size.
@@ -69,9 +83,12 @@ public:
     // Compute the index corresponding to the size request, and
     // return an object allocated from that heap.
     int index = getIndex (sz);
+    if (!_initialized[index]) {
+      initializeHeap (index);
+    }
     void * ptr = getHeap(index)->malloc (sz);
     
-    if (DieFast) {
+    if (DieFast && (ptr != NULL)) {
       // Fill with special value.
       size_t actualSize = getClassSize (index);
       DieFast::fill (ptr, actualSize, _localRandomValue);
@@ -79,8 +96,74 @@ public:
     
     return ptr;
   }
+
+  /// @brief Allocate an object of the requested size, filled with zeroes.
+  /// @return such an object, or NULL.
+  inline void * calloc (size_t sz) {
+    if (sz > MaxSize) {
+      return NULL;
+    }
+    int index = getIndex (sz);
+    if (!_initialized[index]) {
+      initializeHeap (index);
+    }
+    // NB: no DieFast fill: the object is zeroed (only if need be) instead.
+    return getHeap(index)->calloc (sz);
+  }
   
   
+  /// @brief Allocates an object from a size class chosen at compile time.
+  /// @param Index  the size class (objects of sizeof(double) << Index bytes).
+  /// @note  Calls the class's RandomHeap directly, not through its vtable.
+  template <int Index>
+  inline void * mallocClass (void) {
+    // NB: out-of-range classes compile (as the largest) but are never
+    // called; see CombineHeap::mallocClass.
+    enum { INDEX = (Index < MAX_INDEX) ? Index : MAX_INDEX - 1 };
+    typedef typename ClassHeap<INDEX>::Type TheHeap;
+    if (!_initialized[INDEX]) {
+      initializeHeap (INDEX);
+    }
+    TheHeap * heap = (TheHeap *) getHeap (INDEX);
+    void * ptr = heap->TheHeap::malloc (ClassHeap<INDEX>::SIZE);
+    if (DieFast && (ptr != NULL)) {
+      DieFast::fill (ptr, ClassHeap<INDEX>::SIZE, _localRandomValue);
+    }
+    return ptr;
+  }
+
+  /// @brief Frees an object allocated by mallocClass<Index>.
+  template <int Index>
+  inline bool freeClass (void * ptr) {
+    enum { INDEX = (Index < MAX_INDEX) ? Index : MAX_INDEX - 1 };
+    typedef typename ClassHeap<INDEX>::Type TheHeap;
+    if (OwnershipMap::getObjectSize (ptr) == (size_t) ClassHeap<INDEX>::SIZE) {
+      return (_initialized[INDEX] && ((TheHeap *) getHeap (INDEX))->TheHeap::free (ptr));
+    }
+    // Not from this class after all (e.g., a large object).
+    return freeDirect (ptr);
+  }
+
+  /// @brief Allocates n objects of the same size, with one size-class lookup.
+  /// @return the number of objects allocated (0 if sz is too big).
+  inline size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    if (sz > MaxSize) {
+      return 0;
+    }
+    int index = getIndex (sz);
+    if (!_initialized[index]) {
+      initializeHeap (index);
+    }
+    size_t count = getHeap(index)->mallocBatch (sz, n, ptrs);
+    if (DieFast) {
+      size_t actualSize = getClassSize (index);
+      for (size_t i = 0; i < count; i++) {
+	DieFast::fill (ptrs[i], actualSize, _localRandomValue);
+      }
+    }
+    return count;
+  }
+  
   /// @brief Relinquishes ownership of this pointer.
   /// @return true iff the object was on this heap.
   inline bool free (void * ptr) {
@@ -88,7 +171,7 @@ public:
     // We assume that the common case is when objects are small,
     // so we check the smaller heaps first.
     for (int i = 0; i < MAX_INDEX; i++) {
-      if (getHeap(i)->free (ptr))
+      if (_initialized[i] && getHeap(i)->free (ptr))
 	// Successfully freed.
 	return true;
     }
@@ -96,24 +179,103 @@ public:
     // If we get here, the object could be a "big" object.
     return false;
   }
+
+  /// @brief Relinquishes an object whose requested size the caller knows.
+  /// @return true iff the object was on this heap.
+  inline bool freeSized (void * ptr, size_t sz) {
+    // The size must fit the object's slot.
+    assert ((OwnershipMap::getObjectSize (ptr) == 0)
+	    || (sz <= OwnershipMap::getObjectSize (ptr)));
+    // NB: the slot, not sz, names the class (realloc may have shrunk
+    // the object in place).
+    return freeDirect (ptr);
+  }
   
   
+  /// @brief Frees every object in ptrs that is on this heap (skipping NULLs).
+  /// @return true iff all of them were.
+  inline bool freeBatch (size_t n, void ** ptrs) {
+    bool allOurs = true;
+    for (size_t i = 0; i < n; i++) {
+      void * ptr = ptrs[i];
+      if (ptr == NULL) {
+	continue;
+      }
+      if (!freeDirect (ptr)) {
+	allOurs = false;
+      }
+    }
+    return allOurs;
+  }
+  
+  // No locks of our own; the shared miniheap allocator is locked
+  // separately (see MiniHeapAllocator).
+  void lockAll (void) {}
+  void unlockAll (void) {}
+
+  /// @brief Gives every size class a fresh random sequence.
+  /// @note  DieFast fill values are kept: memory already holds them.
+  void reseed (void) {
+    for (int i = 0; i < MAX_INDEX; i++) {
+      if (_initialized[i]) {
+	getHeap(i)->reseed();
+      }
+    }
+  }
+
+  /// @brief Frees every object at once, returning the memory to the system.
+  void releaseAll (void) {
+    for (int i = 0; i < MAX_INDEX; i++) {
+      if (_initialized[i]) {
+	getHeap(i)->releaseAll();
+      }
+    }
+  }
+
   /// @return the space available from this point in the given object
   /// @note returns 0 if this object is not managed by this heap
+  /// @note Safe to call without holding the heap lock.
   inline size_t getSize (void * ptr) {
-    // Iterate, from smallest to largest, checking for the given
-    // object size.
-    for (int i = 0; i < MAX_INDEX; i++) {
-      size_t sz = getHeap(i)->getSize (ptr);
-      if (sz != 0)
-	return sz;
-    }
-    // If we get here, the object could be a "big" object.
-    return 0;
+    // Every active miniheap is in the ownership map, so this needs
+    // neither a lock nor a search through the size classes.
+    // If it returns 0, the object could be a "big" object.
+    return OwnershipMap::getSize (ptr);
+  }
+
+  /// @brief Resizes an object in place, if it still fits its slot.
+  /// @return ptr if the object can now hold sz bytes, or NULL.
+  /// @note Safe to call without holding the heap lock.
+  inline void * resize (void * ptr, size_t sz) {
+    size_t s = getSize (ptr);
+    return ((s > 0) && (sz <= s)) ? ptr : NULL;
+  }
+
+  /// @brief As resize: small objects never move.
+  inline bool resizeInPlace (void * ptr, size_t sz) {
+    return (resize (ptr, sz) != NULL);
+  }
+
+  /// @return the usable size of an object allocated for sz bytes (its slot size).
+  static inline size_t roundSize (size_t sz) {
+    assert (sz <= MaxSize);
+    return getClassSize (getIndex (sz));
   }
   
 private:
   
+  /// @brief Frees an object from the class the ownership map names for
+  ///        it, without searching through the size classes.
+  /// @return true iff the object was on this heap (and is now freed).
+  /// @note  An invalid or double free is reported (once) by that class.
+  inline bool freeDirect (void * ptr) {
+    size_t sz = OwnershipMap::getObjectSize (ptr);
+    if ((sz == 0) || (sz > MaxSize)) {
+      return false;
+    }
+    int index = getIndex (sz);
+    return (_initialized[index] && getHeap(index)->free (ptr));
+  }
+
   /// @return the maximum object size for the given index.
   static inline size_t getClassSize (int index) {
     assert (index >= 0);
@@ -129,20 +291,44 @@ private:
     return index;
   }
 
+  /// The concrete heap type for the given index.
+  template <int index>
+  class ClassHeap {
+  public:
+    enum { SIZE = (1 << index) * sizeof(double) }; // NB: = getClassSize(index)
+    typedef RandomHeap<Numerator, Denominator, SIZE, MaxSize, RandomMiniHeap, DieFast> Type;
+  };
+
   template <int index>
   class Initializer {
   public:
-    static void run (void * buf) {
+    static void run (void * buf, unsigned int owner,
+		     MaskingBudget<Numerator, Denominator> * budget) {
       new ((char *) buf + MINIHEAPSIZE * index)
-	RandomHeap<Numerator,
-	Denominator,
-	(1 << index) * sizeof(double), // NB: = getClassSize(index)
-	MaxSize,
-        RandomMiniHeap,
-	DieFast>();
+	typename ClassHeap<index>::Type (owner, budget);
+    }
+  };
+
+  typedef void InitializerFunction (void *, unsigned int,
+				    MaskingBudget<Numerator, Denominator> *);
+
+  /// Records Initializer<index>::run, so heaps can be built from a run-time index.
+  template <int index>
+  class Registrar {
+  public:
+    static void run (InitializerFunction ** table) {
+      table[index] = &Initializer<index>::run;
     }
   };
 
+  /// Constructs the heap for the given index, the first time it is needed.
+  NO_INLINE void initializeHeap (int index) {
+    assert (!_initialized[index]);
+    (*_initializers[index]) ((void *) _buf, _owner, &_budget);
+    _budget.add (getHeap (index));
+    _initialized[index] = true;
+  }
+
   /// @return the heap corresponding to the given index.
   inline RandomHeapBase<Numerator, Denominator> * getHeap (int index) const {
     // Return the requested heap.
@@ -157,6 +343,18 @@ private:
   /// A random value used for detecting overflows (for DieFast).
   const size_t _localRandomValue;
 
+  /// The owner tag recorded for our miniheaps.
+  const unsigned int _owner;
+
+  /// The constructor for each heap, indexed by size class.
+  InitializerFunction * _initializers[MAX_INDEX];
+
+  /// True iff the heap for the given index has been constructed.
+  bool _initialized[MAX_INDEX];
+
+  /// The size classes' shared masking budget (used only with a masking probability).
+  MaskingBudget<Numerator, Denominator> _budget;
+
   // The buffer that holds each RandomHeap.
   char _buf[MINIHEAPSIZE * MAX_INDEX];
 
@@ -0,0 +1,298 @@
+// -*- C++ -*-
+
+/**
+ * @file   heapconfig.h
+ * @brief  The heap's run-time configuration, read from DIEHARD_* environment variables.
+ * @sa     configuredheap.h
+ */
+
+#ifndef _HEAPCONFIG_H_
+#define _HEAPCONFIG_H_
+
+#include <stddef.h>
+
+#include "diehard.h"
+
+#if defined(_WIN32)
+#include <stdlib.h>
+#define DIEHARD_ENVIRON _environ
+#else
+#include <unistd.h>
+extern char ** environ;
+#define DIEHARD_ENVIRON environ
+#endif
+
+/**
+ * @class HeapConfig
+ * @brief The settings the heap is built with, chosen once at startup.
+ *
+ * The variables are:
+ *  - DIEHARD_M: the heap multiplier, as "2" or "4/3" (default 4/3).
+ *    Above MAX_MULTIPLIER (4, the largest any heap supports), it is
+ *    clamped to MAX_MULTIPLIER; otherwise, the denominator may be at
+ *    most MAX_TERM;
+ *  - DIEHARD_DIEFAST: 1 to fill and check freed objects, 0 not to
+ *    (default: the build's DIEHARD_DIEFAST; other values are malformed);
+ *  - DIEHARD_LARGE_THRESHOLD: the largest object size, in bytes,
+ *    kept in the randomized heap; bigger ones are mapped directly
+ *    (default 65536, which is also the maximum: larger values are
+ *    clamped to it);
+ *  - DIEHARD_MASKING_PROBABILITY: the multiplier, given instead as a
+ *    probability p, such as 0.9, that an overflow from a live object
+ *    into another slot lands on free space. It replaces the compiled-in
+ *    multiplier in every build: each size class keeps p of its slots
+ *    free (a multiplier of 1/(1-p), so 0.75 is M = 4), and fills
+ *    further only when the heap's other classes have free slots to
+ *    spare (see MaskingBudget). p is clamped to [MIN_PROBABILITY,
+ *    MAX_PROBABILITY] (M from 8/7 to 16), and DIEHARD_M is ignored
+ *    if it is also set.
+ *
+ * A heap supports only some of these values (see ConfiguredHeap).
+ *
+ * Reading them walks environ and parses digits by hand, so it never
+ * allocates (it runs inside the first malloc) and is async-signal-safe.
+ * Malformed values are ignored, and values that are ignored or clamped
+ * are reported on stderr.
+ */
+
+class HeapConfig {
+public:
+
+  HeapConfig (void)
+    : _numerator (4),
+      _denominator (3),
+      _dieFast (DIEHARD_DIEFAST == 1),
+      _largeThreshold (65536),
+      _maskingProbability (0)
+  {}
+
+  /// Probabilities are fixed-point fractions of this.
+  enum { PROBABILITY_SCALE = 65536 };
+
+  /// The largest multiplier, the largest numerator or denominator
+  /// accepted for it, and the largest threshold.
+  enum { MAX_MULTIPLIER = 4, MAX_TERM = 65536, MAX_LARGE_THRESHOLD = 65536 };
+
+  /// The range of masking probabilities. Allocation probes random slots
+  /// until one is free, so keeping less than 1/8 free would make it
+  /// slow (over 8 probes, on average); above 15/16, memory grows
+  /// without bound as p nears 1.
+  enum { MIN_PROBABILITY = PROBABILITY_SCALE / 8,
+	 MAX_PROBABILITY = PROBABILITY_SCALE - PROBABILITY_SCALE / 16 };
+
+  /// @return the configuration from the environment, read on first use.
+  static const HeapConfig& get (void) {
+    static HeapConfig config = fromEnvironment();
+    return config;
+  }
+
+  /// @return the defaults, overridden by any DIEHARD_* variables set.
+  static HeapConfig fromEnvironment (void) {
+    HeapConfig config;
+    unsigned long n, d;
+    // The probability first: it works in any build, so it wins if
+    // DIEHARD_M is set too.
+    const char * value = getVariable ("DIEHARD_MASKING_PROBABILITY");
+    if (value != NULL) {
+      if (!parseProbability (value, n)) {
+	warn ("DieHard: ignoring malformed DIEHARD_MASKING_PROBABILITY\n");
+      } else {
+	if (n < MIN_PROBABILITY) {
+	  warn ("DieHard: DIEHARD_MASKING_PROBABILITY is below 0.125; using 0.125\n");
+	  n = MIN_PROBABILITY;
+	} else if (n > MAX_PROBABILITY) {
+	  warn ("DieHard: DIEHARD_MASKING_PROBABILITY is above 0.9375; using 0.9375\n");
+	  n = MAX_PROBABILITY;
+	}
+	config._maskingProbability = (unsigned int) n;
+      }
+    }
+    value = getVariable ("DIEHARD_M");
+    if (value != NULL) {
+      if (config._maskingProbability != 0) {
+	warn ("DieHard: DIEHARD_MASKING_PROBABILITY is set; ignoring DIEHARD_M\n");
+      } else if (!parseRatio (value, n, d) || (n == 0) || (d == 0)) {
+	warn ("DieHard: ignoring malformed DIEHARD_M\n");
+      } else if (d <= (n - 1) / MAX_MULTIPLIER) {
+	// NB: n / d > MAX_MULTIPLIER, tested without overflow.
+	warn ("DieHard: DIEHARD_M is above 4; using 4\n");
+	config._numerator = MAX_MULTIPLIER;
+	config._denominator = 1;
+      } else if (d > MAX_TERM) {
+	warn ("DieHard: ignoring malformed DIEHARD_M\n");
+      } else {
+	config._numerator = (int) n;
+	config._denominator = (int) d;
+      }
+    }
+    value = getVariable ("DIEHARD_DIEFAST");
+    if (value != NULL) {
+      if (!parseNumber (value, n) || (n > 1)) {
+	warn ("DieHard: ignoring malformed DIEHARD_DIEFAST\n");
+      } else {
+	config._dieFast = (n != 0);
+      }
+    }
+    value = getVariable ("DIEHARD_LARGE_THRESHOLD");
+    if (value != NULL) {
+      if (!parseNumber (value, n)) {
+	warn ("DieHard: ignoring malformed DIEHARD_LARGE_THRESHOLD\n");
+      } else {
+	if (n > MAX_LARGE_THRESHOLD) {
+	  warn ("DieHard: DIEHARD_LARGE_THRESHOLD is above 65536; using 65536\n");
+	  n = MAX_LARGE_THRESHOLD;
+	}
+	config._largeThreshold = (size_t) n;
+      }
+    }
+    return config;
+  }
+
+  /// @brief Compares this multiplier with n/d.
+  /// @return true iff it is no larger.
+  inline bool multiplierAtMost (int n, int d) const {
+    return ((long long) _numerator * d <= (long long) n * _denominator);
+  }
+
+  inline bool dieFast (void) const {
+    return _dieFast;
+  }
+
+  inline size_t largeThreshold (void) const {
+    return _largeThreshold;
+  }
+
+  /// @return the masking probability (out of PROBABILITY_SCALE) that
+  ///         replaces the multiplier, or 0 for none.
+  inline unsigned int maskingProbability (void) const {
+    return _maskingProbability;
+  }
+
+  // Allocation-free environment parsing and reporting, shared with
+  // RealRandomValue (for DIEHARD_SEED) and ConfiguredHeap.
+
+  /// @return the value of the named environment variable, or NULL.
+  static const char * getVariable (const char * name) {
+    char ** env = DIEHARD_ENVIRON;
+    if (env == NULL) {
+      return NULL;
+    }
+    for (; *env != NULL; env++) {
+      const char * s = *env;
+      const char * n = name;
+      while ((*n != '\0') && (*s == *n)) {
+	s++;
+	n++;
+      }
+      if ((*n == '\0') && (*s == '=')) {
+	return s + 1;
+      }
+    }
+    return NULL;
+  }
+
+  /// @brief Writes a message about the settings to stderr, without allocating.
+  static void warn (const char * message) {
+#if !defined(_WIN32)
+    size_t len = 0;
+    while (message[len] != '\0') {
+      len++;
+    }
+    ssize_t written = write (2, message, len);
+    (void) written;
+#else
+    (void) message;
+#endif
+  }
+
+  /// @brief Parses a decimal number, which must be all of s.
+  static bool parseNumber (const char * s, unsigned long& value) {
+    return (parseDigits (s, value) && (*s == '\0'));
+  }
+
+private:
+
+  /// @brief Parses "n" or "n/d".
+  static bool parseRatio (const char * s, unsigned long& n, unsigned long& d) {
+    if (!parseDigits (s, n)) {
+      return false;
+    }
+    d = 1;
+    if (*s == '/') {
+      s++;
+      if (!parseDigits (s, d)) {
+	return false;
+      }
+    }
+    return (*s == '\0');
+  }
+
+  /// @brief Parses a fraction in [0, 1), such as "0.95" or ".95".
+  /// @param value  the fraction, out of PROBABILITY_SCALE (rounded up).
+  static bool parseProbability (const char * s, unsigned long& value) {
+    if (s == NULL) {
+      return false;
+    }
+    if (*s == '0') {
+      s++;
+    }
+    if (*s != '.') {
+      return false;
+    }
+    s++;
+    unsigned long long n = 0, d = 1;
+    for (; (*s >= '0') && (*s <= '9'); s++) {
+      // Digits past the ninth cannot change the result.
+      if (d < 1000000000ULL) {
+	n = n * 10 + (*s - '0');
+	d *= 10;
+      }
+    }
+    if ((*s != '\0') || (n == 0)) {
+      return false;
+    }
+    value = (unsigned long) ((n * PROBABILITY_SCALE + d - 1) / d);
+    if (value >= PROBABILITY_SCALE) {
+      value = PROBABILITY_SCALE - 1;
+    }
+    return true;
+  }
+
+  /// @brief Parses the digits at the start of s, advancing s past them.
+  /// @param value  the number, saturated at the largest unsigned long
+  ///               (so too-large values are clamped, not wrapped).
+  /// @return false if there are none.
+  static bool parseDigits (const char *& s, unsigned long& value) {
+    if ((s == NULL) || (*s < '0') || (*s > '9')) {
+      return false;
+    }
+    const unsigned long maxValue = (unsigned long) -1;
+    value = 0;
+    for (; (*s >= '0') && (*s <= '9'); s++) {
+      unsigned long digit = (unsigned long) (*s - '0');
+      if (value > (maxValue - digit) / 10) {
+	value = maxValue;
+      } else {
+	value = value * 10 + digit;
+      }
+    }
+    return true;
+  }
+
+  /// The heap multiplier, M = _numerator / _denominator (at most
+  /// MAX_MULTIPLIER, with _denominator at most MAX_TERM).
+  int _numerator;
+  int _denominator;
+
+  /// True iff freed objects are filled and checked (DieFast).
+  bool _dieFast;
+
+  /// The largest size served by the randomized heap.
+  size_t _largeThreshold;
+
+  /// The masking probability, out of PROBABILITY_SCALE (0 = none).
+  unsigned int _maskingProbability;
+
+};
+
+#endif
@@ -0,0 +1,220 @@
+// -*- C++ -*-
+
+/**
+ * @file   heapinstance.h
+ * @brief  Independent DieHard heaps, created and destroyed at run time.
+ * @sa     diehardapi.h
+ */
+
+#ifndef _HEAPINSTANCE_H_
+#define _HEAPINSTANCE_H_
+
+#include <new>
+
+#include "ansiwrapper.h"
+#include "combineheap.h"
+#include "diehardheap.h"
+#include "lock.h"
+#include "lockheap.h"
+#include "mmapwrapper.h"
+#include "ownedlargeheap.h"
+
+/**
+ * @class HeapInstanceBase
+ * @brief The interface to a heap instance, whatever its configuration.
+ *
+ * Live instances are kept in a table (see HeapInstances), so that
+ * fork can hold their locks and reseed them, as for the main heap,
+ * and so that each has a small index (e.g., for MALLOCX_ARENA).
+ */
+
+class HeapInstanceBase {
+public:
+
+  virtual void * malloc (size_t) = 0;
+  virtual void * calloc (size_t) = 0;
+  virtual void * memalign (size_t, size_t) = 0;
+  virtual bool free (void *) = 0;
+  virtual bool resizeInPlace (void *, size_t) = 0;
+  virtual size_t roundSize (size_t, size_t) = 0;
+  virtual void lockAll (void) = 0;
+  virtual void unlockAll (void) = 0;
+  virtual void reseed (void) = 0;
+
+  /// @brief Frees every object, and then the instance itself.
+  virtual void destroy (void) = 0;
+
+  /// This instance's slot in the HeapInstances table.
+  int _index;
+
+protected:
+
+  virtual ~HeapInstanceBase () {}
+
+};
+
+
+/**
+ * @class HeapInstance
+ * @brief A complete heap, with its own lock, size classes and large objects.
+ *
+ * Its mini heaps are carved from the instance's own reserved regions,
+ * and its large objects are tracked, so destroy costs one unmap per
+ * mapping rather than one free per object.
+ */
+
+template <int Numerator,
+	  int Denominator,
+	  bool DieFast>
+class HeapInstance : public HeapInstanceBase {
+public:
+
+  /// @return a new instance, in memory of its own, or NULL.
+  static HeapInstanceBase * create (void) {
+    void * buf = MmapWrapper::map (sizeof(HeapInstance));
+    if (buf == NULL) {
+      return NULL;
+    }
+    return new (buf) HeapInstance;
+  }
+
+  void * malloc (size_t sz) {
+    return _heap.malloc (sz);
+  }
+
+  void * calloc (size_t sz) {
+    return _heap.calloc (sz);
+  }
+
+  void * memalign (size_t alignment, size_t sz) {
+    return _heap.memalign (alignment, sz);
+  }
+
+  bool free (void * ptr) {
+    return _heap.free (ptr);
+  }
+
+  bool resizeInPlace (void * ptr, size_t sz) {
+    return _heap.resizeInPlace (ptr, sz);
+  }
+
+  size_t roundSize (size_t alignment, size_t sz) {
+    return _heap.roundSize (alignment, sz);
+  }
+
+  void lockAll (void) {
+    _heap.lockAll();
+  }
+
+  void unlockAll (void) {
+    _heap.unlockAll();
+  }
+
+  void reseed (void) {
+    _heap.reseed();
+  }
+
+  void destroy (void) {
+    _heap.releaseAll();
+    this->~HeapInstance();
+    MmapWrapper::unmap (this, sizeof(HeapInstance));
+  }
+
+private:
+
+  typedef ANSIWrapper<LockHeap<CombineHeap<DieHardHeap<Numerator, Denominator, 65536, DieFast>,
+					   OwnedLargeHeap> > > TheHeapType;
+
+  TheHeapType _heap;
+
+};
+
+
+/**
+ * @class HeapInstances
+ * @brief The table of live heap instances.
+ *
+ * Lookups by index take no lock. Lock order: this table's lock, then
+ * an instance's lock (which comes before the shared miniheap
+ * allocators' locks).
+ */
+
+class HeapInstances {
+public:
+
+  /// The most instances that can be live at once.
+  enum { MAX_INSTANCES = 256 };
+
+  /// @return true iff h now has a slot (false if the table is full).
+  static bool add (HeapInstanceBase * h) {
+    bool added = false;
+    getLock().lock();
+    for (int i = 0; i < MAX_INSTANCES; i++) {
+      if (getTable()[i] == NULL) {
+	h->_index = i;
+	getTable()[i] = h;
+	added = true;
+	break;
+      }
+    }
+    getLock().unlock();
+    return added;
+  }
+
+  static void remove (HeapInstanceBase * h) {
+    getLock().lock();
+    getTable()[h->_index] = NULL;
+    getLock().unlock();
+  }
+
+  /// @return the instance in the given slot, or NULL.
+  static inline HeapInstanceBase * get (int index) {
+    if ((index < 0) || (index >= MAX_INSTANCES)) {
+      return NULL;
+    }
+    return getTable()[index];
+  }
+
+  /// @brief Holds the table's lock and every instance's locks (e.g., before fork).
+  static void lockAll (void) {
+    getLock().lock();
+    for (int i = 0; i < MAX_INSTANCES; i++) {
+      if (getTable()[i] != NULL) {
+	getTable()[i]->lockAll();
+      }
+    }
+  }
+
+  static void unlockAll (void) {
+    for (int i = MAX_INSTANCES - 1; i >= 0; i--) {
+      if (getTable()[i] != NULL) {
+	getTable()[i]->unlockAll();
+      }
+    }
+    getLock().unlock();
+  }
+
+  static void reseed (void) {
+    for (int i = 0; i < MAX_INSTANCES; i++) {
+      if (getTable()[i] != NULL) {
+	getTable()[i]->reseed();
+      }
+    }
+  }
+
+private:
+
+  static HeapInstanceBase * volatile * getTable (void) {
+    // Zero-initialized, so there is no guard to check.
+    static HeapInstanceBase * volatile table[MAX_INSTANCES];
+    return table;
+  }
+
+  static Lock& getLock (void) {
+    static Lock lock;
+    return lock;
+  }
+
+};
+
+#endif
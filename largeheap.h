@@ -3,82 +3,238 @@
 
 #include <assert.h>
 
+#include "backgroundunmapper.h"
 #include "checkpoweroftwo.h"
 #include "staticlog.h"
 #include "mmapwrapper.h"
+#include "pagemap.h"
 
 
 class LargeHeap {
 public:
 
   void * malloc (size_t sz) {
+    if (tooBig (sz)) {
+      return NULL;
+    }
     void * ptr = MmapWrapper::map (sz);
-    set (ptr, sz);
+    if ((ptr != NULL) && !set (ptr, sz)) {
+      // Unrecorded, free could never find it: give it back instead.
+      MmapWrapper::unmap (ptr, sz);
+      return NULL;
+    }
     return ptr;
   }
 
+  /// @brief Fresh anonymous mappings are already zero.
+  void * calloc (size_t sz) {
+    return malloc (sz);
+  }
+
+  /// @return an object of sz bytes aligned to alignment (a power of two).
+  void * memalign (size_t alignment, size_t sz) {
+    if (alignment <= PAGE_SIZE) {
+      return malloc (sz);
+    }
+    if (tooBig (sz) || (roundUp (sz) > ~(size_t) 0 - (alignment - PAGE_SIZE))) {
+      return NULL;
+    }
+    // Map enough to contain an aligned object, then unmap the excess
+    // on either side, so the object is exactly one mapping.
+    size_t extent = roundUp (sz);
+    char * ptr = (char *) MmapWrapper::map (extent + alignment - PAGE_SIZE);
+    if (ptr == NULL) {
+      return NULL;
+    }
+    char * aligned = (char *) (((size_t) ptr + alignment - 1) & ~(alignment - 1));
+    if (aligned > ptr) {
+      MmapWrapper::unmap (ptr, aligned - ptr);
+    }
+    char * end = ptr + extent + alignment - PAGE_SIZE;
+    if (end > aligned + extent) {
+      MmapWrapper::unmap (aligned + extent, end - (aligned + extent));
+    }
+    if (!set (aligned, sz)) {
+      MmapWrapper::unmap (aligned, extent);
+      return NULL;
+    }
+    return aligned;
+  }
+
   bool free (void * ptr) {
     // If we allocated this object, free it.
     size_t sz = get(ptr);
     if (sz > 0) {
-      MmapWrapper::unmap (ptr, sz);
+      // Forget the object before its pages go away, so a concurrent
+      // (lock-free) size lookup never sees a stale size.
       clear (ptr);
+      unmap (ptr, sz);
       return true;
     } else {
       return false;
     }
   }
 
+  /// @brief Resizes an object without copying it: within its last
+  ///        page, by unmapping pages it no longer needs, or by moving
+  ///        its pages to a bigger mapping (mremap).
+  /// @return the object (possibly moved) if it now holds sz bytes, or
+  ///         NULL if it must be copied.
+  void * resize (void * ptr, size_t sz) {
+    return resize (ptr, sz, true);
+  }
+
+  /// @brief Like resize, but never moves the object.
+  /// @return true iff the object now holds sz bytes.
+  bool resizeInPlace (void * ptr, size_t sz) {
+    return (resize (ptr, sz, false) != NULL);
+  }
+
+  /// @return the usable size of an object allocated for sz bytes.
+  static inline size_t roundSize (size_t sz) {
+    // Sizes are recorded exactly, not rounded to pages.
+    return sz;
+  }
+
+  // No locks or random state of our own (see LockHeap::lockAll).
+  void lockAll (void) {}
+  void unlockAll (void) {}
+  void reseed (void) {}
+
+  /// @note Safe to call without holding the heap lock.
   size_t getSize (void * ptr) {
     size_t s = get(ptr);
     if (!s) {
       return 0;
     } else {
-      size_t offset = (size_t) ptr - (getIndex(ptr) << POINTER_SHIFT);
+      size_t offset = (size_t) ptr & (PAGE_SIZE - 1);
       return s - offset;
     }
   }
 
 private:
 
-  inline int getIndex (void * ptr) const {
-    return (size_t) ptr >> POINTER_SHIFT;
+  enum { PAGE_SIZE = PageMap<size_t>::PAGE_SIZE };
+
+  void * resize (void * ptr, size_t sz, bool mayMove) {
+    size_t s = get (ptr);
+    if ((s == 0) || ((size_t) ptr & (PAGE_SIZE - 1)) || (sz == 0) || tooBig (sz)) {
+      return NULL;
+    }
+    size_t oldExtent = roundUp (s);
+    size_t newExtent = roundUp (sz);
+    if (newExtent > oldExtent) {
+      if (mayMove) {
+	return grow (ptr, s, sz);
+      }
+      // Get the map's memory for the new pages first, so recording
+      // them (below) cannot fail.
+      if (!getSizeMap().reserve (ptr, newExtent)
+	  || !MmapWrapper::extend (ptr, oldExtent, newExtent)) {
+	return NULL;
+      }
+      // The new pages were nobody's, so there is nothing to forget.
+      set (ptr, sz);
+      return ptr;
+    }
+    if (newExtent < oldExtent) {
+      // Forget the tail before unmapping it, as in free.
+      getSizeMap().clear ((char *) ptr + newExtent, oldExtent - newExtent);
+      unmap ((char *) ptr + newExtent, oldExtent - newExtent);
+    }
+    set (ptr, sz);
+    return ptr;
   }
-  
+
+  /// @brief Moves an object's pages into a mapping big enough for sz bytes.
+  void * grow (void * ptr, size_t oldSize, size_t sz) {
+    if (tooBig (sz)) {
+      return NULL;
+    }
+    size_t oldExtent = roundUp (oldSize);
+    size_t newExtent = roundUp (sz);
+    // Grow in place if the pages after it are free.
+    if (getSizeMap().reserve (ptr, newExtent)
+	&& MmapWrapper::extend (ptr, oldExtent, newExtent)) {
+      set (ptr, sz);
+      return ptr;
+    }
+    // Otherwise, reserve a destination, and the map's memory for it,
+    // before moving anything: afterwards, the object could not be put back.
+    void * newPtr = MmapWrapper::reserve (newExtent);
+    if (newPtr == NULL) {
+      return NULL;
+    }
+    if (!getSizeMap().reserve (newPtr, newExtent)) {
+      MmapWrapper::unmap (newPtr, newExtent);
+      return NULL;
+    }
+    // Forget the old pages first: once mremap returns, they may be
+    // mapped again (and entered in the map) for another object.
+    getSizeMap().clear (ptr, oldExtent);
+    if (!MmapWrapper::remapTo (ptr, oldExtent, newExtent, newPtr)) {
+      // The object is untouched: put it back.
+      set (ptr, oldSize);
+      MmapWrapper::unmap (newPtr, newExtent);
+      return NULL;
+    }
+    set (newPtr, sz);
+    return newPtr;
+  }
+
+  /// @return true iff sz cannot be rounded up to whole pages (it would wrap to 0).
+  static inline bool tooBig (size_t sz) {
+    return (sz > ~(size_t) 0 - PAGE_SIZE + 1);
+  }
+
+  /// @return sz rounded up to whole pages.
+  /// @note  sz must not be tooBig.
+  static inline size_t roundUp (size_t sz) {
+    return (sz + PAGE_SIZE - 1) & ~((size_t) PAGE_SIZE - 1);
+  }
+
+  /// @brief Returns pages to the system (in the background, if so configured).
+  static inline void unmap (void * ptr, size_t sz) {
+#if DIEHARD_BACKGROUND_UNMAP
+    BackgroundUnmapper::unmap (ptr, sz);
+#else
+    MmapWrapper::unmap (ptr, sz);
+#endif
+  }
+
+  /// @return the size remaining in the object from the start of ptr's page.
   inline size_t get (void * ptr) const {
-    int index = getIndex(ptr);
-    assert (index >= 0);
-    assert (index < SIZE_ENTRIES);
-    return _size[index];
+    return getSizeMap().get (ptr);
   }
   
-  inline void set (void * ptr, size_t sz) {
+  /// @brief Records the object's size for each of its pages.
+  /// @return false (recording nothing) if the map is out of memory.
+  inline bool set (void * ptr, size_t sz) {
+    if (!getSizeMap().reserve (ptr, sz)) {
+      return false;
+    }
     // Initialize a range with the actual size.
-    int index = getIndex(ptr);
     size_t currSize = sz;
-    int iterations = (sz + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (int i = 0; i < iterations; i++) {
-      assert (index + i < SIZE_ENTRIES);
-      _size[index + i] = currSize;
+    size_t iterations = (sz + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (size_t i = 0; i < iterations; i++) {
+      getSizeMap().set ((char *) ptr + i * PAGE_SIZE, PAGE_SIZE, currSize);
       currSize -= PAGE_SIZE;
     }
+    return true;
   }
   
   inline void clear (void * ptr) {
-    int index = getIndex(ptr);
-    size_t sz = _size[index];
-    int iterations = (sz + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (int i = 0; i < iterations; i++) {
-      assert (index + i < SIZE_ENTRIES);
-      _size[index + i] = 0;
-    }
+    size_t sz = get (ptr);
+    getSizeMap().clear (ptr, sz);
   }
 
-  enum { PAGE_SIZE = 4096 };
-  enum { POINTER_SHIFT = StaticLog<PAGE_SIZE>::VALUE };
-  enum { SIZE_ENTRIES = 1 << (32 - POINTER_SHIFT) };
-
-  size_t _size[SIZE_ENTRIES];
+  /// @return the map from pages to object sizes.
+  /// @note  Shared by every LargeHeap: a page belongs to at most one object.
+  static inline PageMap<size_t>& getSizeMap (void) {
+    // Zero-initialized (no constructor), so there is no guard to check.
+    static PageMap<size_t> sizeMap;
+    return sizeMap;
+  }
 
 };
 
@@ -3,8 +3,123 @@
 
 extern volatile int anyThreadCreated;
 
-#if !defined(_WIN32)
+/// Counters kept by every Lock, updated while the lock is held.
+struct LockStatistics {
+  /// The number of times the lock was acquired.
+  unsigned long long acquisitions;
+  /// The number of acquisitions that found the lock already held.
+  unsigned long long contended;
+  /// Total cycles (or ticks) spent waiting in contended acquisitions.
+  unsigned long long waitCycles;
+};
+
+#if defined(linux)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "platformspecific.h"
+
+/**
+ * @class Lock
+ * @brief Spins briefly, then sleeps on a futex.
+ *
+ * Allocator critical sections are short, so a waiter usually gets the
+ * lock within a few hundred cycles of spinning; only long waits pay
+ * for a trip into the kernel. The state follows Drepper's "Futexes
+ * Are Tricky": 0 = unlocked, 1 = locked, 2 = locked with sleepers.
+ */
+
+class Lock {
+public:
+  Lock (void)
+    : _state (0)
+  {
+    _stats.acquisitions = 0;
+    _stats.contended = 0;
+    _stats.waitCycles = 0;
+  }
+
+  inline void lock (void) {
+    if (anyThreadCreated) {
+      if (__sync_val_compare_and_swap (&_state, 0, 1) != 0) {
+	contendedLock();
+      }
+      _stats.acquisitions++;
+    }
+  }
+
+  inline void unlock (void) {
+    if (anyThreadCreated) {
+      // NB: this also leaves the lock free if it was never taken
+      // (e.g., anyThreadCreated was set while we were inside).
+      if (__sync_fetch_and_sub (&_state, 1) != 1) {
+	_state = 0;
+	syscall (SYS_futex, &_state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+      }
+    }
+  }
+
+  /// @brief Copies out the statistics (racy unless the lock is held).
+  void getStatistics (LockStatistics& stats) const {
+    stats = _stats;
+  }
+
+private:
+
+  /// How many times to spin before sleeping.
+  enum { SPIN_COUNT = 128 };
+
+  NO_INLINE void contendedLock (void) {
+    unsigned long long start = cycles();
+    for (int i = 0; i < SPIN_COUNT; i++) {
+      pause();
+      if ((_state == 0) && (__sync_val_compare_and_swap (&_state, 0, 1) == 0)) {
+	recordWait (start);
+	return;
+      }
+    }
+    // Announce that there is a sleeper, and wait until we get the lock.
+    while (__sync_lock_test_and_set (&_state, 2) != 0) {
+      syscall (SYS_futex, &_state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+    recordWait (start);
+  }
+
+  // Called with the lock held.
+  inline void recordWait (unsigned long long start) {
+    _stats.contended++;
+    _stats.waitCycles += cycles() - start;
+  }
+
+  static inline void pause (void) {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  static inline unsigned long long cycles (void) {
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int lo, hi;
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long) hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+  }
+
+  volatile int _state;
+
+  LockStatistics _stats;
+};
+
+#elif !defined(_WIN32)
 #include <pthread.h>
+#include <sys/time.h>
 
 class Lock {
 public:
@@ -16,21 +131,38 @@ public:
     // e.g., PTHREAD_MUTEX_INITIALIZER -- but Linux doesn't
     // necessarily define it.
     memset (&_lock, 0, sizeof(pthread_mutex_t));
+    memset (&_stats, 0, sizeof(LockStatistics));
   }
 
   inline void lock (void) {
-    if (anyThreadCreated)
-      pthread_mutex_lock (&_lock);
+    if (anyThreadCreated) {
+      if (pthread_mutex_trylock (&_lock) != 0) {
+	// Contended: time the wait in microseconds.
+	struct timeval start, end;
+	gettimeofday (&start, NULL);
+	pthread_mutex_lock (&_lock);
+	gettimeofday (&end, NULL);
+	_stats.contended++;
+	_stats.waitCycles += (end.tv_sec - start.tv_sec) * 1000000ULL
+	  + (end.tv_usec - start.tv_usec);
+      }
+      _stats.acquisitions++;
+    }
   }
 
   inline void unlock (void) {
     if (anyThreadCreated)
       pthread_mutex_unlock (&_lock);
   }
-  
+
+  void getStatistics (LockStatistics& stats) const {
+    stats = _stats;
+  }
+
 private:
   pthread_mutexattr_t _attr;
   pthread_mutex_t _lock;
+  LockStatistics _stats;
 
 };
 
@@ -44,16 +176,28 @@ public:
   Lock (void)
     : _lock (0)
   {
+    _stats.acquisitions = 0;
+    _stats.contended = 0;
+    _stats.waitCycles = 0;
   }
 
   inline void lock (void) {
-    if (anyThreadCreated)
-      while (InterlockedExchange ((long *) &_lock, 1) != 0) {
-	while (_lock == 1) {
-	  _MM_PAUSE;
-	  Sleep (0);
+    if (anyThreadCreated) {
+      if (InterlockedExchange ((long *) &_lock, 1) != 0) {
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter (&start);
+	while (InterlockedExchange ((long *) &_lock, 1) != 0) {
+	  while (_lock == 1) {
+	    _MM_PAUSE;
+	    Sleep (0);
+	  }
 	}
+	QueryPerformanceCounter (&end);
+	_stats.contended++;
+	_stats.waitCycles += end.QuadPart - start.QuadPart;
       }
+      _stats.acquisitions++;
+    }
   }
 
   inline void unlock (void) {
@@ -66,10 +210,16 @@ public:
     }
   }
 
+  void getStatistics (LockStatistics& stats) const {
+    stats = _stats;
+  }
+
 private:
 
   volatile long _lock;
 
+  LockStatistics _stats;
+
 };
 
 
@@ -17,6 +17,44 @@ public:
     return ptr;
   }
 
+  inline void * calloc (size_t sz) {
+    lock ();
+    void * ptr = SuperHeap::calloc (sz);
+    unlock ();
+    return ptr;
+  }
+
+  template <int Index>
+  inline void * mallocClass (void) {
+    lock ();
+    void * ptr = SuperHeap::template mallocClass<Index>();
+    unlock ();
+    return ptr;
+  }
+
+  template <int Index>
+  inline bool freeClass (void * ptr) {
+    lock();
+    bool ret = SuperHeap::template freeClass<Index> (ptr);
+    unlock();
+    return ret;
+  }
+
+  /// @brief Allocates n objects under a single acquisition of the lock.
+  inline size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    lock ();
+    size_t count = SuperHeap::mallocBatch (sz, n, ptrs);
+    unlock ();
+    return count;
+  }
+
+  inline void * memalign (size_t alignment, size_t sz) {
+    lock ();
+    void * ptr = SuperHeap::memalign (alignment, sz);
+    unlock ();
+    return ptr;
+  }
+
   inline bool free (void * ptr) {
     lock();
     bool ret = SuperHeap::free (ptr);
@@ -24,11 +62,58 @@ public:
     return ret;
   }
 
+  inline bool freeSized (void * ptr, size_t sz) {
+    lock();
+    bool ret = SuperHeap::freeSized (ptr, sz);
+    unlock();
+    return ret;
+  }
+
+  /// @brief Frees n objects under a single acquisition of the lock.
+  inline bool freeBatch (size_t n, void ** ptrs) {
+    lock();
+    bool ret = SuperHeap::freeBatch (n, ptrs);
+    unlock();
+    return ret;
+  }
+
+  inline void * resize (void * ptr, size_t sz) {
+    lock();
+    void * ret = SuperHeap::resize (ptr, sz);
+    unlock();
+    return ret;
+  }
+
+  inline bool resizeInPlace (void * ptr, size_t sz) {
+    lock();
+    bool ret = SuperHeap::resizeInPlace (ptr, sz);
+    unlock();
+    return ret;
+  }
+
+  /// @note No lock: every heap below answers size queries from
+  /// metadata that is immutable (or published atomically) once set.
   inline size_t getSize (void * ptr) {
+    return SuperHeap::getSize (ptr);
+  }
+
+  /// @brief Acquires this lock, then any locks inside the heap (e.g., before fork).
+  inline void lockAll (void) {
+    lock();
+    SuperHeap::lockAll();
+  }
+
+  /// @brief Releases the locks taken by lockAll, innermost first.
+  inline void unlockAll (void) {
+    SuperHeap::unlockAll();
+    unlock();
+  }
+
+  /// @brief Reports how often (and how long) callers waited for the heap lock.
+  void getLockStatistics (LockStatistics& stats) {
     lock();
-    size_t sz = SuperHeap::getSize (ptr);
+    _lock.getStatistics (stats);
     unlock();
-    return sz;
   }
 
 private:
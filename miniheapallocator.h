@@ -0,0 +1,37 @@
+// -*- C++ -*-
+
+/**
+ * @file   miniheapallocator.h
+ * @brief  The process-wide sources of memory for mini heaps and their metadata.
+ */
+
+#ifndef _MINIHEAPALLOCATOR_H_
+#define _MINIHEAPALLOCATOR_H_
+
+#include "diehard.h"
+#include "bumpalloc.h"
+#include "lockheap.h"
+#include "mmapalloc.h"
+#include "numaalloc.h"
+#include "oneheap.h"
+#include "recycleheap.h"
+
+/// The allocator for every mini heap's objects. It is shared by every
+/// RandomHeap, possibly under different locks, so it has its own.
+/// NB: mini heaps are whole pages, so each gets a fresh chunk, which
+/// (with DIEHARD_NUMA) lands on the node of the thread activating it.
+#if DIEHARD_NUMA
+typedef OneHeap<LockHeap<BumpAlloc<NUMAAlloc<MmapAlloc>, 4096> > > MiniHeapAllocator;
+#else
+typedef OneHeap<LockHeap<BumpAlloc<MmapAlloc, 4096> > > MiniHeapAllocator;
+#endif
+
+/// The allocator for mini heap metadata (bitmaps). Keeping it apart
+/// from the objects packs all of it onto a few pages, rather than a
+/// page per bitmap, so that after fork the metadata writes dirty only
+/// those pages. (NB: the chunk size also makes this a distinct OneHeap.)
+/// Bitmaps of released mini heaps (see diehard_heap_destroy) are
+/// recycled for new ones.
+typedef OneHeap<LockHeap<RecycleHeap<BumpAlloc<MmapAlloc, 65536> > > > MiniHeapMetadataAllocator;
+
+#endif
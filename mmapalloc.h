@@ -25,6 +25,11 @@ public:
     return ptr;
   }
   static void free (void *) {}
+
+  // No locks or random state (see LockHeap::lockAll).
+  static void lockAll (void) {}
+  static void unlockAll (void) {}
+  static void reseed (void) {}
 };
 
 #endif
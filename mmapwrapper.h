@@ -20,6 +20,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <string.h>
 #endif
 
 
@@ -57,6 +58,26 @@ public:
     return  ptr;
   }
   
+  static void * reserve (size_t sz) {
+    return VirtualAlloc (NULL, sz, MEM_RESERVE, PAGE_NOACCESS);
+  }
+
+  static bool commit (void * ptr, size_t sz) {
+    return (VirtualAlloc (ptr, sz, MEM_COMMIT, MMAP_PROTECTION) != NULL);
+  }
+
+  static void * remap (void *, size_t, size_t) {
+    return NULL;
+  }
+
+  static bool remapTo (void *, size_t, size_t, void *) {
+    return false;
+  }
+
+  static bool extend (void *, size_t, size_t) {
+    return false;
+  }
+
   static bool unmap (void * ptr, size_t) {
     size_t sz = getSize (ptr);
     if (sz) {
@@ -71,6 +92,11 @@ public:
     VirtualAlloc (ptr, sz, MEM_COMMIT, MMAP_PROTECTION);
   }
 
+  /// @brief Replaces the pages in [ptr, ptr + sz) with zero-filled ones.
+  static void zero (void * ptr, size_t sz) {
+    dontneed (ptr, sz);
+  }
+
   static void protect (void * ptr, size_t sz) {
     DWORD oldProtection;
     VirtualProtect (ptr, sz, PAGE_NOACCESS, &oldProtection);
@@ -128,10 +154,67 @@ public:
     }
   }
 
+  /// @brief Reserves address space only: it is inaccessible until committed.
+  static void * reserve (size_t sz) {
+#if defined(MAP_ANONYMOUS) && defined(MAP_NORESERVE)
+    void * ptr = mmap (NULL, sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+#else
+    return NULL;
+#endif
+  }
+
+  /// @brief Grows (or shrinks) a mapping, moving its pages rather than copying them.
+  /// @return the new address, or NULL if the mapping could not be resized.
+  static void * remap (void * ptr, size_t oldSize, size_t newSize) {
+#if defined(linux) && defined(MREMAP_MAYMOVE)
+    void * newPtr = mremap (ptr, oldSize, newSize, MREMAP_MAYMOVE);
+    return (newPtr == MAP_FAILED) ? NULL : newPtr;
+#else
+    return NULL;
+#endif
+  }
+
+  /// @brief Moves a mapping's pages to dest (replacing whatever is
+  ///        mapped there), resizing it to newSize.
+  static bool remapTo (void * ptr, size_t oldSize, size_t newSize, void * dest) {
+#if defined(linux) && defined(MREMAP_MAYMOVE) && defined(MREMAP_FIXED)
+    return (mremap (ptr, oldSize, newSize, MREMAP_MAYMOVE | MREMAP_FIXED, dest) == dest);
+#else
+    return false;
+#endif
+  }
+
+  /// @brief Grows (or shrinks) a mapping where it is, if the pages after it are free.
+  static bool extend (void * ptr, size_t oldSize, size_t newSize) {
+#if defined(linux) && defined(MREMAP_MAYMOVE)
+    return (mremap (ptr, oldSize, newSize, 0) == ptr);
+#else
+    return false;
+#endif
+  }
+
+  /// @brief Makes part of a reserved range usable.
+  static bool commit (void * ptr, size_t sz) {
+    return (mprotect ((char *) ptr, sz, MMAP_PROTECTION_MASK) == 0);
+  }
+
   static void dontneed (void * ptr, size_t sz) {
     madvise ((caddr_t) ptr, sz, MADV_DONTNEED);
   }
 
+  /// @brief Replaces the pages in [ptr, ptr + sz) with zero-filled ones.
+  static void zero (void * ptr, size_t sz) {
+#if defined(linux)
+    // Linux refills private pages dropped this way with zeroes.
+    madvise ((caddr_t) ptr, sz, MADV_DONTNEED);
+#elif defined(MAP_ANONYMOUS)
+    mmap (ptr, sz, MMAP_PROTECTION_MASK, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+#else
+    memset (ptr, 0, sz);
+#endif
+  }
+
   static bool unmap (void * ptr, size_t sz) {
     if (munmap (reinterpret_cast<char *>(ptr), sz) == 0) {
       return true;
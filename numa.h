@@ -0,0 +1,107 @@
+// -*- C++ -*-
+
+/**
+ * @file   numa.h
+ * @brief  Finds the caller's NUMA node, and places memory on a node.
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <stdlib.h>
+
+#include "currentcpu.h"
+
+#if defined(linux)
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @class NUMA
+ * @brief Thin, allocation-free wrappers around the Linux NUMA calls.
+ *
+ * Everything degrades gracefully: on a single-node machine, or one
+ * without NUMA support (or where mbind is forbidden), every thread is
+ * on node 0 and binding memory is a harmless no-op.
+ */
+
+class NUMA {
+public:
+
+  /// @return the node this thread is running on (0 if unknown).
+  static inline int currentNode (void) {
+#if defined(linux)
+    // CPUs never change nodes, so remember each CPU's node, and look
+    // the CPU up through rseq rather than making a system call.
+    int cpu = CurrentCPU::get();
+    if ((cpu >= 0) && (cpu < MAX_CPUS)) {
+      int node = getNodeOf()[cpu];
+      if (node > 0) {
+	return node - 1;
+      }
+    }
+    return lookupNode();
+#else
+    return 0;
+#endif
+  }
+
+  /// @brief Asks the kernel to place the (untouched) range on the given node.
+  /// @note  Uses a preferred policy, so a full node spills to another
+  ///        rather than failing allocations.
+  static void bind (void * ptr, size_t sz, int node) {
+#if defined(linux) && defined(SYS_mbind)
+    if ((node < 0) || (node >= (int) (sizeof(unsigned long) * 8))) {
+      return;
+    }
+    unsigned long mask = 1UL << node;
+    // Ignore failures (e.g., ENOSYS or EPERM): placement is only a hint.
+    syscall (SYS_mbind, ptr, sz, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+#endif
+  }
+
+private:
+
+  /// The most CPUs whose nodes we remember.
+  enum { MAX_CPUS = 1024 };
+
+#if defined(linux)
+
+  NO_INLINE static int lookupNode (void) {
+    unsigned int cpu = 0, node = 0;
+    if (syscall (SYS_getcpu, &cpu, &node, NULL) != 0) {
+      return 0;
+    }
+    if (cpu < MAX_CPUS) {
+      getNodeOf()[cpu] = (short) (node + 1);
+    }
+    return (int) node;
+  }
+
+  /// @return each CPU's node plus one (0 = not yet known).
+  static inline volatile short * getNodeOf (void) {
+    static volatile short nodeOf[MAX_CPUS];
+    return nodeOf;
+  }
+
+#endif
+
+};
+
+
+/**
+ * @class CurrentNode
+ * @brief Shards a PerCPUHeap by NUMA node (see PerCPUHeap's Where).
+ */
+
+class CurrentNode {
+public:
+  static inline int get (void) {
+    return NUMA::currentNode();
+  }
+};
+
+#endif
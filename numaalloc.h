@@ -0,0 +1,38 @@
+// -*- C++ -*-
+
+/**
+ * @file   numaalloc.h
+ * @brief  Places each chunk it obtains on the caller's NUMA node.
+ */
+
+#ifndef _NUMAALLOC_H_
+#define _NUMAALLOC_H_
+
+#include "numa.h"
+
+/**
+ * @class NUMAAlloc
+ * @brief Binds memory from Super (e.g., MmapAlloc) to the caller's node.
+ *
+ * Super must return fresh, untouched pages, so the binding takes
+ * effect before the first fault. With a node-sharded front end
+ * (PerCPUHeap with CurrentNode), the caller is allocating for its own
+ * node's shard, so that shard's memory stays on that node for the
+ * life of the process.
+ */
+
+template <class Super>
+class NUMAAlloc : public Super {
+public:
+
+  static void * malloc (size_t sz) {
+    void * ptr = Super::malloc (sz);
+    if (ptr != NULL) {
+      NUMA::bind (ptr, sz, NUMA::currentNode());
+    }
+    return ptr;
+  }
+
+};
+
+#endif
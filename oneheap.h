@@ -13,10 +13,22 @@ public:
     return getHeap().free (ptr);
   }
 
+  static inline bool freeSized (void * ptr, size_t sz) {
+    return getHeap().freeSized (ptr, sz);
+  }
+
   static inline size_t getSize (void * ptr) {
     return getHeap().getSize (ptr);
   }
 
+  static inline void lockAll (void) {
+    getHeap().lockAll();
+  }
+
+  static inline void unlockAll (void) {
+    getHeap().unlockAll();
+  }
+
 private:
 
   static inline TheHeap& getHeap (void) {
@@ -0,0 +1,77 @@
+// -*- C++ -*-
+
+/**
+ * @file   ownedlargeheap.h
+ * @brief  A LargeHeap that remembers its own objects, so it can free them all at once.
+ * @sa     largeheap.h, heapinstance.h
+ */
+
+#ifndef _OWNEDLARGEHEAP_H_
+#define _OWNEDLARGEHEAP_H_
+
+#include "addressset.h"
+#include "largeheap.h"
+
+/**
+ * @class OwnedLargeHeap
+ * @brief Tracks the objects it allocated, and frees only those.
+ *
+ * Every LargeHeap shares one size map, so a plain LargeHeap would
+ * free any large object at all. This one keeps a set of its own
+ * objects, which lets releaseAll unmap them (one unmap apiece) and
+ * makes free reject objects from any other heap. Not thread-safe:
+ * use it under a lock (e.g., LockHeap).
+ */
+
+class OwnedLargeHeap : public LargeHeap {
+public:
+
+  void * malloc (size_t sz) {
+    void * ptr = LargeHeap::malloc (sz);
+    if ((ptr != NULL) && !_objects.insert (ptr)) {
+      LargeHeap::free (ptr);
+      return NULL;
+    }
+    return ptr;
+  }
+
+  void * calloc (size_t sz) {
+    return malloc (sz);
+  }
+
+  void * memalign (size_t alignment, size_t sz) {
+    void * ptr = LargeHeap::memalign (alignment, sz);
+    if ((ptr != NULL) && !_objects.insert (ptr)) {
+      LargeHeap::free (ptr);
+      return NULL;
+    }
+    return ptr;
+  }
+
+  /// @return true iff the object was one of ours (and is now freed).
+  bool free (void * ptr) {
+    if (!_objects.remove (ptr)) {
+      return false;
+    }
+    return LargeHeap::free (ptr);
+  }
+
+  /// @brief Frees every object we still hold, then the set itself.
+  void releaseAll (void) {
+    for (size_t i = 0; i < _objects.capacity(); i++) {
+      void * ptr = _objects.at (i);
+      if (ptr != NULL) {
+	LargeHeap::free (ptr);
+      }
+    }
+    _objects.clear();
+  }
+
+private:
+
+  /// The objects allocated here and not yet freed.
+  AddressSet _objects;
+
+};
+
+#endif
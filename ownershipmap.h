@@ -0,0 +1,105 @@
+// -*- C++ -*-
+
+/**
+ * @file   ownershipmap.h
+ * @brief  Records which pages belong to which miniheap, for lock-free size lookups.
+ * @sa     pagemap.h, randomminiheap.h
+ */
+
+#ifndef _OWNERSHIPMAP_H_
+#define _OWNERSHIPMAP_H_
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "checkpoweroftwo.h"
+#include "pagemap.h"
+#include "staticlog.h"
+
+/**
+ * @class OwnershipMap
+ * @brief Maps every page of an active miniheap to the miniheap's base, object size and owner.
+ *
+ * Each entry is the (page-aligned) miniheap base with log2 of its
+ * object size in the low six bits and an owner tag (e.g., the shard
+ * of a PerCPUHeap) in the next six. Miniheap bounds and object sizes never
+ * change once activated, so a size lookup is one map read and a bit
+ * of arithmetic, with no lock and no search through size classes.
+ */
+
+class OwnershipMap {
+public:
+
+  /// The number of distinct owner tags.
+  enum { MAX_OWNERS = 64 };
+
+  /// @brief Records a newly-activated miniheap holding objects of ObjectSize bytes.
+  /// @return false (recording nothing) if the map is out of memory.
+  template <size_t ObjectSize>
+  static bool registerMiniHeap (void * base, size_t sz, unsigned int owner) {
+    CheckPowerOfTwo<ObjectSize> _SizeIsPowerOfTwo;
+    assert (((size_t) base & (SIZE_MASK | OWNER_MASK)) == 0);
+    assert (owner < MAX_OWNERS);
+    if (!getMap().reserve (base, sz)) {
+      return false;
+    }
+    // Publish the miniheap's own state before its pages become visible.
+    __sync_synchronize();
+    getMap().set (base, sz,
+		  (size_t) base
+		  | ((size_t) owner << OWNER_SHIFT)
+		  | (size_t) StaticLog<ObjectSize>::VALUE);
+    return true;
+  }
+
+  /// @brief Forgets a miniheap (e.g., when its memory is released).
+  static void unregisterMiniHeap (void * base, size_t sz) {
+    getMap().clear (base, sz);
+  }
+
+  /// @return the space available from this point in the object, or 0 if not in any miniheap.
+  static inline size_t getSize (void * ptr) {
+    size_t entry = getMap().get (ptr);
+    if (entry == 0) {
+      return 0;
+    }
+    size_t base = entry & ~(size_t) (SIZE_MASK | OWNER_MASK);
+    size_t objectSize = (size_t) 1 << (entry & SIZE_MASK);
+    return objectSize - (((size_t) ptr - base) & (objectSize - 1));
+  }
+
+  /// @return the object size of the miniheap holding ptr, or 0 if none.
+  static inline size_t getObjectSize (void * ptr) {
+    size_t entry = getMap().get (ptr);
+    if (entry == 0) {
+      return 0;
+    }
+    return (size_t) 1 << (entry & SIZE_MASK);
+  }
+
+  /// @return the owner tag of the miniheap holding ptr, or -1 if none.
+  static inline int getOwner (void * ptr) {
+    size_t entry = getMap().get (ptr);
+    if (entry == 0) {
+      return -1;
+    }
+    return (int) ((entry & OWNER_MASK) >> OWNER_SHIFT);
+  }
+
+private:
+
+  /// The low bits of an entry, which hold log2 of the object size.
+  enum { SIZE_MASK = 63 };
+
+  /// The bits above those, which hold the owner tag.
+  enum { OWNER_SHIFT = 6,
+	 OWNER_MASK = (MAX_OWNERS - 1) << OWNER_SHIFT };
+
+  static inline PageMap<size_t>& getMap (void) {
+    // Zero-initialized (no constructor), so there is no guard to check.
+    static PageMap<size_t> map;
+    return map;
+  }
+};
+
+#endif
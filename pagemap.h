@@ -0,0 +1,162 @@
+// -*- C++ -*-
+
+/**
+ * @file   pagemap.h
+ * @brief  A two-level radix map from pages to values, readable without locks.
+ */
+
+#ifndef _PAGEMAP_H_
+#define _PAGEMAP_H_
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "mmapwrapper.h"
+#include "staticlog.h"
+
+/**
+ * @class PageMap
+ * @brief Associates a value with every page of the address space.
+ * @param Value  an integral type; pages that were never set read as 0.
+ *
+ * Leaves are mapped on demand and published with a compare-and-swap,
+ * and never go away, so readers need no lock: a reader sees either 0
+ * or a value that a writer stored (writers must still serialize among
+ * themselves when they update overlapping ranges).
+ *
+ * The class has no constructor, so a static instance is zero-filled
+ * before any code runs and is usable from inside malloc at any time.
+ */
+
+template <class Value>
+class PageMap {
+public:
+
+  enum { PAGE_SIZE = 4096 };
+  enum { PAGE_SHIFT = StaticLog<PAGE_SIZE>::VALUE };
+
+  /// @return the value for the page holding ptr (0 if none was set).
+  inline Value get (const void * ptr) const {
+    size_t page = (size_t) ptr >> PAGE_SHIFT;
+    size_t top = page >> LEAF_BITS;
+    if (top >= TOP_ENTRIES) {
+      return 0;
+    }
+    Value * leaf = _top[top];
+    if (leaf == NULL) {
+      return 0;
+    }
+    return ((volatile Value *) leaf)[page & (LEAF_ENTRIES - 1)];
+  }
+
+  /// @brief Sets the value of every page in [ptr, ptr + sz).
+  /// @return false if the map could not get memory for a leaf.
+  bool set (const void * ptr, size_t sz, Value v) {
+    size_t first = (size_t) ptr >> PAGE_SHIFT;
+    size_t last = ((size_t) ptr + sz - 1) >> PAGE_SHIFT;
+    for (size_t page = first; page <= last; page++) {
+      Value * leaf = getLeaf (page >> LEAF_BITS);
+      if (leaf == NULL) {
+	return false;
+      }
+      ((volatile Value *) leaf)[page & (LEAF_ENTRIES - 1)] = v;
+    }
+    return true;
+  }
+
+  /// @brief Makes sure the map has memory for every page in [ptr, ptr + sz),
+  ///        so a later set of that range cannot fail.
+  /// @return false if the map could not get memory for a leaf.
+  bool reserve (const void * ptr, size_t sz) {
+    size_t first = ((size_t) ptr >> PAGE_SHIFT) >> LEAF_BITS;
+    size_t last = (((size_t) ptr + sz - 1) >> PAGE_SHIFT) >> LEAF_BITS;
+    for (size_t top = first; top <= last; top++) {
+      if (getLeaf (top) == NULL) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  /// @brief Resets every page in [ptr, ptr + sz) to 0.
+  ///
+  /// Works a leaf at a time, handing whole pages of entries back to
+  /// the OS, so the cost follows the number of leaves the range
+  /// touches rather than the number of pages in it.
+  void clear (const void * ptr, size_t sz) {
+    size_t page = (size_t) ptr >> PAGE_SHIFT;
+    size_t last = ((size_t) ptr + sz - 1) >> PAGE_SHIFT;
+    while (page <= last) {
+      size_t top = page >> LEAF_BITS;
+      if (top >= TOP_ENTRIES) {
+	break;
+      }
+      size_t from = page & (LEAF_ENTRIES - 1);
+      size_t to = ((last >> LEAF_BITS) == top)
+	? (last & (LEAF_ENTRIES - 1)) + 1
+	: (size_t) LEAF_ENTRIES;
+      if (_top[top] != NULL) {
+	clearEntries (_top[top], from, to);
+      }
+      page = (top + 1) << LEAF_BITS;
+    }
+  }
+
+private:
+
+  /// The number of address bits we map (user space on current 64-bit systems).
+  enum { ADDRESS_BITS = (sizeof(void *) == 8) ? 48 : 32 };
+  enum { LEAF_BITS = (ADDRESS_BITS - PAGE_SHIFT) / 2 };
+  enum { TOP_BITS = ADDRESS_BITS - PAGE_SHIFT - LEAF_BITS };
+  enum { LEAF_ENTRIES = 1 << LEAF_BITS };
+  enum { TOP_ENTRIES = 1 << TOP_BITS };
+
+  /// The number of entries in one page of a leaf.
+  enum { ENTRIES_PER_PAGE = MmapWrapper::Size / sizeof(Value) };
+
+  /// @brief Zeroes leaf[from, to): the entries sharing a page with
+  ///        others one at a time, and the whole pages between them at once.
+  static void clearEntries (Value * leaf, size_t from, size_t to) {
+    size_t firstWhole = (from + ENTRIES_PER_PAGE - 1) & ~(size_t) (ENTRIES_PER_PAGE - 1);
+    size_t endWhole = to & ~(size_t) (ENTRIES_PER_PAGE - 1);
+    if (firstWhole >= endWhole) {
+      // No whole page: zero every entry one at a time.
+      firstWhole = endWhole = to;
+    } else {
+      MmapWrapper::zero (leaf + firstWhole, (endWhole - firstWhole) * sizeof(Value));
+    }
+    for (size_t i = from; i < firstWhole; i++) {
+      ((volatile Value *) leaf)[i] = 0;
+    }
+    for (size_t i = endWhole; i < to; i++) {
+      ((volatile Value *) leaf)[i] = 0;
+    }
+  }
+
+  Value * getLeaf (size_t top) {
+    if (top >= TOP_ENTRIES) {
+      return NULL;
+    }
+    Value * leaf = _top[top];
+    if (leaf == NULL) {
+      // Fresh mappings are zero-filled, so the new leaf is all "unset".
+      Value * newLeaf = (Value *) MmapWrapper::map (LEAF_ENTRIES * sizeof(Value));
+      if (newLeaf == NULL) {
+	return NULL;
+      }
+      // Make the leaf visible; if someone beat us to it, use theirs.
+      leaf = __sync_val_compare_and_swap (&_top[top], (Value *) NULL, newLeaf);
+      if (leaf == NULL) {
+	leaf = newLeaf;
+      } else {
+	MmapWrapper::unmap (newLeaf, LEAF_ENTRIES * sizeof(Value));
+      }
+    }
+    return leaf;
+  }
+
+  /// The top level of the radix tree.
+  Value * volatile _top[TOP_ENTRIES];
+};
+
+#endif
@@ -0,0 +1,270 @@
+// -*- C++ -*-
+
+/**
+ * @file   percpuheap.h
+ * @brief  Shards a heap by CPU (or by NUMA node).
+ * @sa     ownershipmap.h
+ */
+
+#ifndef _PERCPUHEAP_H_
+#define _PERCPUHEAP_H_
+
+#include <assert.h>
+#include <new>
+
+#include "currentcpu.h"
+#include "lock.h"
+#include "ownershipmap.h"
+#include "platformspecific.h"
+
+/**
+ * @class PerCPUHeap
+ * @brief Gives each CPU its own instance of SmallHeap, with its own lock.
+ * @param SmallHeap  the sharded heap; it takes an OwnershipMap tag
+ *                   (the shard number) in its constructor.
+ * @param MaxShards  the most shards (CPUs) to use.
+ * @param Where      finds the caller's shard: CurrentCPU, or
+ *                   CurrentNode (numa.h) for one shard per node.
+ *
+ * Unlike per-thread caches, memory grows with the number of CPUs, not
+ * threads: shards are only constructed once a thread runs on that CPU.
+ * The current CPU comes from the thread's rseq area, which the kernel
+ * keeps up to date, so finding a shard costs a load rather than a
+ * system call. A thread that migrates after that load just takes
+ * another shard's (still correct) lock. Frees go to the shard that
+ * owns the object, found through the OwnershipMap.
+ *
+ * Without rseq, we fall back to sched_getcpu(), and failing that, to
+ * a single shard behind its lock (see currentcpu.h).
+ */
+
+template <class SmallHeap,
+	  int MaxShards = OwnershipMap::MAX_OWNERS,
+	  class Where = CurrentCPU>
+class PerCPUHeap {
+public:
+
+  enum { MAX_SIZE = SmallHeap::MAX_SIZE };
+  enum { MAX_ALIGNMENT = SmallHeap::MAX_ALIGNMENT };
+
+  PerCPUHeap (void)
+  {
+    sassert<(MaxShards <= OwnershipMap::MAX_OWNERS)> ensureShardsHaveDistinctTags;
+    for (int i = 0; i < MaxShards; i++) {
+      _initialized[i] = false;
+    }
+  }
+
+  inline void * malloc (size_t sz) {
+    int index = getCurrentShard();
+    Shard& s = getShard (index);
+    s.lock.lock();
+    void * ptr = s.getHeap()->malloc (sz);
+    s.lock.unlock();
+    return ptr;
+  }
+
+  inline void * calloc (size_t sz) {
+    int index = getCurrentShard();
+    Shard& s = getShard (index);
+    s.lock.lock();
+    void * ptr = s.getHeap()->calloc (sz);
+    s.lock.unlock();
+    return ptr;
+  }
+
+  template <int Index>
+  inline void * mallocClass (void) {
+    int index = getCurrentShard();
+    Shard& s = getShard (index);
+    s.lock.lock();
+    void * ptr = s.getHeap()->template mallocClass<Index>();
+    s.lock.unlock();
+    return ptr;
+  }
+
+  template <int Index>
+  inline bool freeClass (void * ptr) {
+    int owner = OwnershipMap::getOwner (ptr);
+    if ((owner < 0) || (owner >= MaxShards) || !_initialized[owner]) {
+      return false;
+    }
+    Shard& s = _shards[owner];
+    s.lock.lock();
+    bool result = s.getHeap()->template freeClass<Index> (ptr);
+    s.lock.unlock();
+    return result;
+  }
+
+  inline size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    int index = getCurrentShard();
+    Shard& s = getShard (index);
+    s.lock.lock();
+    size_t count = s.getHeap()->mallocBatch (sz, n, ptrs);
+    s.lock.unlock();
+    return count;
+  }
+
+  inline bool free (void * ptr) {
+    int owner = OwnershipMap::getOwner (ptr);
+    if ((owner < 0) || (owner >= MaxShards) || !_initialized[owner]) {
+      // Not one of ours (e.g., a big object).
+      return false;
+    }
+    Shard& s = _shards[owner];
+    s.lock.lock();
+    bool result = s.getHeap()->free (ptr);
+    s.lock.unlock();
+    return result;
+  }
+
+  inline bool freeSized (void * ptr, size_t sz) {
+    int owner = OwnershipMap::getOwner (ptr);
+    if ((owner < 0) || (owner >= MaxShards) || !_initialized[owner]) {
+      return false;
+    }
+    Shard& s = _shards[owner];
+    s.lock.lock();
+    bool result = s.getHeap()->freeSized (ptr, sz);
+    s.lock.unlock();
+    return result;
+  }
+
+  /// @brief Frees each run of objects from the same shard under one
+  ///        acquisition of that shard's lock.
+  /// @return true iff every non-NULL object was on some shard.
+  inline bool freeBatch (size_t n, void ** ptrs) {
+    bool allOurs = true;
+    size_t i = 0;
+    while (i < n) {
+      int owner = (ptrs[i] == NULL) ? -1 : OwnershipMap::getOwner (ptrs[i]);
+      if ((owner < 0) || (owner >= MaxShards) || !_initialized[owner]) {
+	allOurs &= (ptrs[i] == NULL);
+	i++;
+	continue;
+      }
+      size_t start = i;
+      while ((i < n) && (ptrs[i] != NULL) && (OwnershipMap::getOwner (ptrs[i]) == owner)) {
+	i++;
+      }
+      Shard& s = _shards[owner];
+      s.lock.lock();
+      allOurs &= s.getHeap()->freeBatch (i - start, ptrs + start);
+      s.lock.unlock();
+    }
+    return allOurs;
+  }
+
+  /// @note Lock-free, as for the underlying heap.
+  inline size_t getSize (void * ptr) {
+    return OwnershipMap::getSize (ptr);
+  }
+
+  /// @note Lock-free: a small object can only be resized within its slot.
+  inline void * resize (void * ptr, size_t sz) {
+    size_t s = OwnershipMap::getSize (ptr);
+    return ((s > 0) && (sz <= s)) ? ptr : NULL;
+  }
+
+  inline bool resizeInPlace (void * ptr, size_t sz) {
+    return (resize (ptr, sz) != NULL);
+  }
+
+  static inline size_t roundSize (size_t sz) {
+    return SmallHeap::roundSize (sz);
+  }
+
+  /// @brief Acquires every shard's lock, in order (e.g., before fork).
+  void lockAll (void) {
+    _initLock.lock();
+    for (int i = 0; i < MaxShards; i++) {
+      if (_initialized[i]) {
+	_shards[i].lock.lock();
+	_shards[i].getHeap()->lockAll();
+      }
+    }
+  }
+
+  void unlockAll (void) {
+    for (int i = MaxShards - 1; i >= 0; i--) {
+      if (_initialized[i]) {
+	_shards[i].getHeap()->unlockAll();
+	_shards[i].lock.unlock();
+      }
+    }
+    _initLock.unlock();
+  }
+
+  void reseed (void) {
+    for (int i = 0; i < MaxShards; i++) {
+      if (_initialized[i]) {
+	_shards[i].getHeap()->reseed();
+      }
+    }
+  }
+
+  /// @brief Sums the statistics of every shard's lock.
+  void getLockStatistics (LockStatistics& stats) {
+    stats.acquisitions = 0;
+    stats.contended = 0;
+    stats.waitCycles = 0;
+    for (int i = 0; i < MaxShards; i++) {
+      if (_initialized[i]) {
+	LockStatistics s;
+	_shards[i].lock.getStatistics (s);
+	stats.acquisitions += s.acquisitions;
+	stats.contended += s.contended;
+	stats.waitCycles += s.waitCycles;
+      }
+    }
+  }
+
+private:
+
+  class Shard {
+  public:
+    Lock lock;
+    inline SmallHeap * getHeap (void) {
+      return (SmallHeap *) _buf;
+    }
+    double _buf[(sizeof(SmallHeap) + sizeof(double) - 1) / sizeof(double)];
+  };
+
+  inline Shard& getShard (int index) {
+    if (!_initialized[index]) {
+      initializeShard (index);
+    }
+    return _shards[index];
+  }
+
+  NO_INLINE void initializeShard (int index) {
+    _initLock.lock();
+    if (!_initialized[index]) {
+      new (_shards[index]._buf) SmallHeap ((unsigned int) index);
+      __sync_synchronize();
+      _initialized[index] = true;
+    }
+    _initLock.unlock();
+  }
+
+  /// @return the shard for the CPU (or node) this thread is running on.
+  static inline int getCurrentShard (void) {
+    int where = Where::get();
+    if (where < 0) {
+      return 0;
+    }
+    return where % MaxShards;
+  }
+
+  /// Serializes shard construction.
+  Lock _initLock;
+
+  /// True iff the given shard has been constructed.
+  volatile bool _initialized[MaxShards];
+
+  /// The shards, constructed on first use.
+  Shard _shards[MaxShards];
+
+};
+
+#endif
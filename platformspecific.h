@@ -19,14 +19,19 @@
 #pragma warning(disable: 4530)
 #pragma warning(disable:4273)
 #define NO_INLINE __declspec(noinline)
+#define INITIAL_EXEC_TLS __declspec(thread)
 
 #elif defined(__GNUC__)
 
 #define NO_INLINE __attribute__ ((noinline))
 //#define inline __attribute__((always_inline))
 
+// Thread-local storage that never calls malloc (or __tls_get_addr) when accessed.
+#define INITIAL_EXEC_TLS __thread __attribute__ ((tls_model ("initial-exec")))
+
 #else
 #define NO_INLINE
+#define INITIAL_EXEC_TLS __thread
 #endif
 
 #endif
@@ -17,12 +17,13 @@
 
 using namespace std;
 
-#include "bumpalloc.h"
 #include "check.h"
+#include "heapconfig.h"
 #include "log2.h"
-#include "mmapalloc.h"
-#include "oneheap.h"
-#include "randomnumbergenerator.h"
+#include "miniheapallocator.h"
+#include "mmapwrapper.h"
+#include "randomnumberbuffer.h"
+#include "reservedregion.h"
 #include "sassert.h"
 #include "staticlog.h"
 
@@ -32,8 +33,114 @@ class RandomHeapBase {
 public:
 
   inline virtual void * malloc (size_t) = 0;
+  inline virtual void * calloc (size_t) = 0;
+  inline virtual size_t mallocBatch (size_t, size_t, void **) = 0;
   inline virtual bool free (void *) = 0;
   inline virtual size_t getSize (void *) = 0;
+  virtual void reseed (void) = 0;
+  virtual void releaseAll (void) = 0;
+
+  /// @return the number of objects in use.
+  virtual size_t getInUse (void) const = 0;
+
+  /// @return the number of slots in active mini heaps.
+  virtual size_t getAvailable (void) const = 0;
+
+};
+
+
+/**
+ * @class MaskingBudget
+ * @brief Holds a heap's size classes to one masking probability, together.
+ *
+ * With a masking probability p (see HeapConfig), each size class first
+ * keeps p of its own slots free. When a class reaches that limit, it
+ * asks here before growing: the target is for the whole heap, an
+ * overflow from any live object, so the class may fill further as long
+ * as the other classes' spare free slots make up the difference.
+ *
+ * The classes holding most of the live objects (hot ones) thus get
+ * just the headroom p needs, since nothing else can make up for them,
+ * while ones holding few objects (cold ones) fill their mini heaps
+ * rather than double them. No class goes below MIN_PROBABILITY free,
+ * since allocation probes for a free slot. The sums are taken only
+ * when a class reaches its limit, so the guarantee holds then; in
+ * between, other classes may use up the slack a class was lent, until
+ * one of them next reaches its limit.
+ *
+ * All of the classes must be under one lock (the heap's).
+ */
+
+template <int Numerator, int Denominator>
+class MaskingBudget {
+public:
+
+  /// The most size classes sharing one budget.
+  enum { MAX_CLASSES = 32 };
+
+  MaskingBudget (void)
+    : _count (0)
+  {}
+
+  /// @brief Adds a size class, once it is built.
+  void add (RandomHeapBase<Numerator, Denominator> * heap) {
+    assert (_count < MAX_CLASSES);
+    _heaps[_count++] = heap;
+  }
+
+  /// @return the most objects the given class may hold in its current
+  ///         slots while the heap still meets p (at least its in-use count).
+  size_t getLimit (const RandomHeapBase<Numerator, Denominator> * heap,
+		   unsigned int p) const {
+    // How far the other classes are above p.
+    long long others = 0;
+    for (int i = 0; i < _count; i++) {
+      if (_heaps[i] != heap) {
+	others += getSlack (_heaps[i]->getInUse(), _heaps[i]->getAvailable(), p);
+      }
+    }
+    size_t available = heap->getAvailable();
+    size_t most = available
+      - (size_t) (((unsigned long long) available * HeapConfig::MIN_PROBABILITY
+		   + HeapConfig::PROBABILITY_SCALE - 1)
+		  / HeapConfig::PROBABILITY_SCALE);
+    // Past p, this class's slack only falls as it fills, so search for
+    // the fullest it may get.
+    size_t lo = heap->getInUse();
+    size_t hi = most;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo + 1) / 2;
+      if (getSlack (mid, available, p) + others >= 0) {
+	lo = mid;
+      } else {
+	hi = mid - 1;
+      }
+    }
+    return (lo > heap->getInUse()) ? lo : heap->getInUse();
+  }
+
+private:
+
+  /// @return how far inUse objects in available slots are above p (below, if
+  ///         negative): inUse times (the chance an overflow from one is masked, less p),
+  ///         out of PROBABILITY_SCALE.
+  static long long getSlack (size_t inUse, size_t available, unsigned int p) {
+    if (inUse == 0) {
+      return 0;
+    }
+    // With inUse objects, an overflow into another slot finds it free
+    // with probability (available - inUse) / (available - 1).
+    long long masked = (long long) ((unsigned long long) (available - inUse)
+				    * HeapConfig::PROBABILITY_SCALE
+				    / ((available > 1) ? available - 1 : 1));
+    return (long long) inUse * (masked - (long long) p);
+  }
+
+  /// The size classes, in the order they were built.
+  RandomHeapBase<Numerator, Denominator> * _heaps[MAX_CLASSES];
+
+  /// The number of size classes.
+  int _count;
 
 };
 
@@ -79,11 +186,17 @@ class RandomHeap : public RandomHeapBase<Numerator, Denominator> {
 
 public:
 
-  RandomHeap (void)
+  /// @param owner   the OwnershipMap tag for this heap's miniheaps.
+  /// @param budget  the masking budget shared with the heap's other
+  ///                size classes, if any.
+  RandomHeap (unsigned int owner = 0,
+	      MaskingBudget<Numerator, Denominator> * budget = NULL)
     : _check1 ((size_t) CHECK1),
-      _random (RealRandomValue::value(), RealRandomValue::value()),
+      _owner (owner),
+      _budget (budget),
       _available (0UL),
       _inUse (0UL),
+      _limit (0UL),
       _miniHeapsInUse (0),
       _chunksInUse (0),
       _check2 ((size_t) CHECK2)
@@ -108,28 +221,26 @@ public:
 
 
   inline void * malloc (size_t sz) {
-    Check<RandomHeap *> sanity (this);
+    return allocate (sz, false);
+  }
 
-    assert (sz <= ObjectSize);
+  /// @return an object whose first sz bytes are zero.
+  inline void * calloc (size_t sz) {
+    return allocate (sz, true);
+  }
 
-    // If we're "out" of memory, get more.
-    while (Numerator * _inUse >= _available * Denominator) {
-      getAnotherMiniHeap();
+  /// @brief Fills ptrs with n objects, each placed independently at random.
+  /// @return the number of objects allocated (n, unless out of memory).
+  inline size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    for (size_t i = 0; i < n; i++) {
+      ptrs[i] = allocate (sz, false);
+      if (ptrs[i] == NULL) {
+	return i;
+      }
     }
-
-    assert (Numerator * _inUse < _available * Denominator);
-    assert (_miniHeapsInUse > 0);
-
-    void * ptr = getObject(sz);
-    assert (ptr != NULL);
-
-    // Bump up the amount of space in use and return.
-    _inUse++;
-    return ptr;
-
+    return n;
   }
 
-
   inline bool free (void * ptr) {
     Check<RandomHeap *> sanity (this);
 
@@ -167,14 +278,72 @@ public:
   }
 
 
+  size_t getInUse (void) const {
+    return _inUse;
+  }
+
+  size_t getAvailable (void) const {
+    return _available;
+  }
+
+  /// @brief Starts a new, independent random sequence (e.g., after fork).
+  void reseed (void) {
+    _random.reseed();
+  }
+
+  /// @brief Frees every object at once, returning the memory to the system.
+  /// @note  Costs one unmap for the region, plus one per mini heap
+  ///        that had to be mapped outside it.
+  void releaseAll (void) {
+    Check<RandomHeap *> sanity (this);
+    for (int i = 0; i < _miniHeapsInUse; i++) {
+      void * buf = getMiniHeap(i)->deactivate();
+      if ((buf != NULL) && !_region.contains (buf)) {
+	// From TheAllocator, which gives each mini heap a chunk of its own.
+	MmapWrapper::unmap (buf, getObjects (i) * ObjectSize);
+      }
+    }
+    _region.release();
+    _available = 0;
+    _inUse = 0;
+    _limit = 0;
+    _miniHeapsInUse = 0;
+    _chunksInUse = 0;
+  }
+
 private:
 
   // Disable copying and assignment.
   RandomHeap (const RandomHeap&);
   RandomHeap& operator= (const RandomHeap&);
 
-  // Pick a random heap, and get an object from it.
-  inline void * getObject (size_t sz) {
+  inline void * allocate (size_t sz, bool zero) {
+    Check<RandomHeap *> sanity (this);
+
+    assert (sz <= ObjectSize);
+
+    // If we're "out" of memory, get more (or, if the rest of the
+    // heap leaves room, use more of what we have).
+    while (_inUse >= _limit) {
+      if (!raiseLimit() && !getAnotherMiniHeap()) {
+	return NULL;
+      }
+    }
+
+    assert (_inUse < _limit);
+    assert (_miniHeapsInUse > 0);
+
+    void * ptr = getObject (sz, zero);
+    assert (ptr != NULL);
+
+    // Bump up the amount of space in use and return.
+    _inUse++;
+    return ptr;
+
+  }
+
+  // Pick a random heap, and get an (optionally zeroed) object from it.
+  inline void * getObject (size_t sz, bool zero) {
     void * ptr = NULL;
     while (!ptr) {
       size_t rnd = _random.next();
@@ -184,13 +353,19 @@ private:
       size_t v      = rnd & _chunksInUse;
       // Compute the index as a log of v (+1 to avoid log2(0)).
       int index  = log2(v + 1);
-      ptr = getMiniHeap(index)->malloc (sz);
+      // The mini-heap draws its slot from our generator too, so only
+      // one generator state per size class needs to stay in cache.
+      if (zero) {
+	ptr = getMiniHeap(index)->calloc (sz, _random.next());
+      } else {
+	ptr = getMiniHeap(index)->malloc (sz, _random.next());
+      }
     }
     return ptr;
   }
 
   // The allocator for the mini heaps.
-  typedef OneHeap<BumpAlloc<MmapAlloc, 4096> > TheAllocator;
+  typedef MiniHeapAllocator TheAllocator;
 
   // The type of a mini heap.
   template <int N> class MiniHeapType
@@ -220,27 +395,83 @@ private:
   }
 
 
+  /// @return the number of objects held by the given mini heap.
+  static inline size_t getObjects (int index) {
+    if (index == 0) {
+      return MIN_OBJECTS;
+    } else {
+      return ((size_t) 1 << (index - 1)) * MIN_OBJECTS;
+    }
+  }
+
   // Activate another mini heap to satisfy the current memory requests.
-  NO_INLINE void getAnotherMiniHeap (void) {
+  /// @return false if there is none left, or no memory for it.
+  NO_INLINE bool getAnotherMiniHeap (void) {
     Check<RandomHeap *> sanity (this);
-    if (_miniHeapsInUse < MAX_MINIHEAPS) {
-      // Update the amount of available space.
-      if( _miniHeapsInUse == 0) {
-        _available += MIN_OBJECTS;
-      } else {
-        _available += (1 << (_miniHeapsInUse-1)) * MIN_OBJECTS;
-      }
-      // Activate the new mini heap.
-      getMiniHeap(_miniHeapsInUse)->activate();
-      // Update the number of mini heaps in use (one more).
-      _miniHeapsInUse++;
-      // Update the number of chunks in use (multiples of MIN_OBJECTS) minus 1.
-      _chunksInUse = (1 << (_miniHeapsInUse - 1)) - 1;
-      assert ((_chunksInUse + 1) * MIN_OBJECTS == _available);
-      // Verifies that it is indeed, a power of two minus 1.
-      assert (((_chunksInUse + 1) & _chunksInUse) == 0);
+    if (_miniHeapsInUse >= MAX_MINIHEAPS) {
+      return false;
+    }
+    size_t objects = getObjects (_miniHeapsInUse);
+    // Activate the new mini heap, preferably inside our region.
+    // NB: if this fails, a piece carved for it stays unused.
+    void * buf = _region.carve (objects * ObjectSize, _random.next());
+    if (!getMiniHeap(_miniHeapsInUse)->activate (_owner, buf)) {
+      return false;
     }
+    // Update the amount of available space.
+    _available += objects;
+    _limit = getLimit (_available);
+    // Update the number of mini heaps in use (one more).
+    _miniHeapsInUse++;
+    // Update the number of chunks in use (multiples of MIN_OBJECTS) minus 1.
+    _chunksInUse = (1 << (_miniHeapsInUse - 1)) - 1;
+    assert ((_chunksInUse + 1) * MIN_OBJECTS == _available);
+    // Verifies that it is indeed, a power of two minus 1.
+    assert (((_chunksInUse + 1) & _chunksInUse) == 0);
     check();
+    return true;
+  }
+
+  /// @return how many objects may be in use, out of available, before we grow.
+  static size_t getLimit (size_t available) {
+    assert (available > 0);
+    unsigned int p = getMaskingProbability();
+    if (p == 0) {
+      // The fixed multiplier: keep available / inUse above Numerator / Denominator.
+      return (available * Denominator + Numerator - 1) / Numerator;
+    }
+    // The multiplier 1/(1-p), in whole slots: an overflow into another
+    // slot is masked iff that slot is free, which with n objects in
+    // use happens with probability (available - n) / (available - 1),
+    // so hold n to the most that keeps this at least p (for this class
+    // alone: see raiseLimit).
+    size_t reserve = (size_t) (((unsigned long long) (available - 1) * p
+				+ HeapConfig::PROBABILITY_SCALE - 1)
+			       / HeapConfig::PROBABILITY_SCALE);
+    return available - reserve;
+  }
+
+  /// @brief Lets us fill further before growing, if the other size
+  ///        classes have the free slots to keep the heap at its masking
+  ///        probability (see MaskingBudget).
+  /// @return true iff the limit went up.
+  NO_INLINE bool raiseLimit (void) {
+    unsigned int p = getMaskingProbability();
+    if ((p == 0) || (_budget == NULL) || (_available == 0)) {
+      return false;
+    }
+    size_t limit = _budget->getLimit (this, p);
+    if (limit <= _inUse) {
+      return false;
+    }
+    _limit = limit;
+    return true;
+  }
+
+  /// @return the masking probability that replaces the multiplier (see HeapConfig), or 0.
+  static unsigned int getMaskingProbability (void) {
+    // NB: read on growth only, so allocation never looks at it.
+    return HeapConfig::get().maskingProbability();
   }
 
   inline void check (void) {
@@ -250,8 +481,14 @@ private:
 
   size_t _check1;
 
-  /// Local random source.
-  RandomNumberGenerator _random;
+  /// The owner tag recorded for our miniheaps.
+  const unsigned int _owner;
+
+  /// The masking budget we share with the heap's other size classes, or NULL.
+  MaskingBudget<Numerator, Denominator> * const _budget;
+
+  /// Local random source, generated in batches off the allocation path.
+  RandomNumberBuffer<> _random;
 
   /// The amount of space available.
   size_t _available;
@@ -259,12 +496,18 @@ private:
   /// The amount of space currently in use (allocated).
   size_t _inUse;
 
+  /// The most space that may be in use before we add a mini heap.
+  size_t _limit;
+
   /// The number of "mini-heaps" currently in use.
   int _miniHeapsInUse;
 
   /// The number of "chunks" in use (multiples of MIN_OBJECTS) minus 1.
   int _chunksInUse;
 
+  /// The address space reserved for this size class's mini heaps.
+  ReservedRegion<MAX_MINIHEAPS> _region;
+
   /// The buffer that holds the various mini heaps.
   char _buf[sizeof(MiniHeapType<MIN_OBJECTS>) * MAX_MINIHEAPS];
 
@@ -13,6 +13,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 extern "C" void reportDoubleFreeError (void);
 extern "C" void reportInvalidFreeError (void);
@@ -22,18 +23,23 @@ extern "C" void reportOverflowError (void);
 #include "bitmap.h"
 #include "check.h"
 #include "checkpoweroftwo.h"
+#include "copyonwrite.h"
 #include "diefast.h"
+#include "miniheapallocator.h"
 #include "modulo.h"
-#include "randomnumbergenerator.h"
+#include "ownershipmap.h"
+#include "realrandomvalue.h"
 #include "sassert.h"
 
 class RandomMiniHeapBase {
 public:
 
-  inline virtual void * malloc (size_t) = 0;
+  inline virtual void * malloc (size_t, unsigned long) = 0;
+  inline virtual void * calloc (size_t, unsigned long) = 0;
   inline virtual bool free (void *) = 0;
   inline virtual size_t getSize (void *) = 0;
-  virtual void activate (void) = 0;
+  virtual bool activate (unsigned int owner, void * buf) = 0;
+  virtual void * deactivate (void) = 0;
   virtual ~RandomMiniHeapBase () {}
 };
 
@@ -72,10 +78,11 @@ public:
 
   RandomMiniHeap (void)
     : _check1 ((size_t) CHECK1),
-      _random (RealRandomValue::value(), RealRandomValue::value()),
+      _freedValue (RealRandomValue::value() | 1), // Enforce invalid pointer value.
       _miniHeap (NULL),
       _inUse (0),
-      _freedValue (_random.next() | 1), // Enforce invalid pointer value.
+      _activation (0),
+      _generation (0),
       _check2 ((size_t) CHECK2)
   {
     Check<RandomMiniHeap *> sanity (this);
@@ -87,36 +94,36 @@ public:
 
   /// @return an allocated object of size ObjectSize
   /// @param sz   requested object size
+  /// @param rnd  a random value (from the caller's generator) that picks the slot
   /// @note May return NULL even though there is free space.
-  inline void * malloc (size_t sz)
+  inline void * malloc (size_t sz, unsigned long rnd)
   {
-    Check<RandomMiniHeap *> sanity (this);
-
-    // Ensure size is reasonable.
-    assert (sz <= ObjectSize);
-    assert (isActivated());
+    int index = allocateIndex (sz, rnd);
+    if (index < 0) {
+      return NULL;
+    }
+    if (!DieFastOn) {
+      _dirtyBitmap.tryToSet (index);
+    }
+    return getObject (index);
+  }
 
-    void * ptr = NULL;
 
-    // Try to allocate an object from the bitmap.
-    int index = (int) (_random.next() & (NObjects - 1));
-    if (!_miniHeapBitmap.tryToSet (index)) {
+  /// @return an allocated object of size ObjectSize, all of it zero
+  ///         (so that its usable size, not just sz, reads as zero)
+  /// @note Like malloc, may return NULL even though there is free space.
+  inline void * calloc (size_t sz, unsigned long rnd)
+  {
+    int index = allocateIndex (sz, rnd);
+    if (index < 0) {
       return NULL;
     }
-
-    _inUse++;
-    
-    // Get the address of the indexed object.
-    assert (index < NObjects);
-    ptr = getObject (index);
-    
-    if (DieFastOn) {
-      // Check to see if this object was overflowed.
-      if (DieFast::checkNot (ptr, ObjectSize, _freedValue)) {
-	reportOverflowError();
-      }
+    void * ptr = getObject (index);
+    // A slot that was never handed out still holds the zeroes mmap
+    // gave us (unless DieFast filled it).
+    if (DieFastOn || !_dirtyBitmap.tryToSet (index)) {
+      memset (ptr, 0, ObjectSize);
     }
-
     return ptr;
   }
 
@@ -157,8 +164,15 @@ public:
       _inUse--;
       if (DieFastOn) {
 	checkOverflowError (ptr, index);
-	// Trash the object.
-	DieFast::fill (ptr, ObjectSize, _freedValue);
+	if (isInherited (index)) {
+	  // Don't touch a page we may share with our parent; just
+	  // remember that this object holds no fill to check.
+	  _unfilledBitmap.tryToSet (index);
+	} else {
+	  // Trash the object.
+	  DieFast::fill (ptr, ObjectSize, _freedValue);
+	  _unfilledBitmap.reset (index);
+	}
       }
       return true;
     } else {
@@ -169,21 +183,58 @@ public:
 
 
   /// @brief Activates the heap, making it ready for allocations.
-  NO_INLINE void activate (void) {
+  /// @param owner  the tag recorded for this miniheap in the OwnershipMap.
+  /// @param buf    fresh memory for the objects, or NULL to get it from Allocator.
+  /// @return true iff the heap is now active (false if out of memory).
+  NO_INLINE bool activate (unsigned int owner, void * buf) {
     if (_miniHeap == NULL) {
       // Go get memory for the heap and the bitmap, making it ready
       // for allocations.
-      _miniHeap = (char *)
-	Allocator::malloc (NObjects * ObjectSize);
+      _miniHeap = (char *) buf;
+      if (_miniHeap == NULL) {
+	_miniHeap = (char *) Allocator::malloc (NObjects * ObjectSize);
+      }
       if (_miniHeap) {
 	_miniHeapBitmap.reserve (NObjects);
 	if (DieFastOn) {
+	  // NB: these pages are new, so filling them breaks no sharing.
 	  DieFast::fill (_miniHeap, NObjects * ObjectSize, _freedValue);
+	  _unfilledBitmap.reserve (NObjects);
+	  _reallocatedBitmap.reserve (NObjects);
+	  // Nothing here was inherited (see isInherited).
+	  _activation = CopyOnWrite::getGeneration();
+	  _generation = _activation;
+	} else {
+	  _dirtyBitmap.reserve (NObjects);
+	}
+	// Let size lookups find this miniheap without taking any lock.
+	// Without that, free and getSize could never find its objects.
+	if (!OwnershipMap::registerMiniHeap<ObjectSize> (_miniHeap, NObjects * ObjectSize, owner)) {
+	  releaseMetadata();
+	  if (buf == NULL) {
+	    // A chunk of its own (see RandomHeap::releaseAll).
+	    MmapWrapper::unmap (_miniHeap, NObjects * ObjectSize);
+	  }
+	  _miniHeap = NULL;
 	}
-      } else {
-	assert (0);
       }
     }
+    return (_miniHeap != NULL);
+  }
+
+
+  /// @brief Forgets every object, and releases the metadata.
+  /// @return the memory that held the objects (for the caller to
+  ///         release), or NULL if the heap was not active.
+  void * deactivate (void) {
+    void * buf = _miniHeap;
+    if (buf != NULL) {
+      OwnershipMap::unregisterMiniHeap (buf, NObjects * ObjectSize);
+      releaseMetadata();
+      _miniHeap = NULL;
+      _inUse = 0;
+    }
+    return buf;
   }
 
 
@@ -191,6 +242,76 @@ private:
 
   // Disable copying and assignment.
   RandomMiniHeap (const RandomMiniHeap&);
+
+  /// @return the index of the (random) slot now allocated, or -1 if it was taken.
+  inline int allocateIndex (size_t sz, unsigned long rnd) {
+    Check<RandomMiniHeap *> sanity (this);
+
+    // Ensure size is reasonable.
+    assert (sz <= ObjectSize);
+    assert (isActivated());
+
+    // Try to allocate an object from the bitmap.
+    int index = (int) (rnd & (NObjects - 1));
+    if (!_miniHeapBitmap.tryToSet (index)) {
+      return -1;
+    }
+
+    _inUse++;
+    assert (index < NObjects);
+
+    if (DieFastOn) {
+      // Check to see if this object was overflowed (if it was filled).
+      if (!_unfilledBitmap.isSet (index)
+	  && DieFast::checkNot (getObject (index), ObjectSize, _freedValue)) {
+	reportOverflowError();
+      }
+      markReallocated (index);
+    }
+
+    return index;
+  }
+
+  void releaseMetadata (void) {
+    _miniHeapBitmap.release();
+    _unfilledBitmap.release();
+    _reallocatedBitmap.release();
+    _dirtyBitmap.release();
+  }
+
+  /// @return true iff the slot may still share its page with a parent
+  ///         process: it was in this heap at the last fork, and has not
+  ///         been handed out since.
+  inline bool isInherited (int index) {
+    unsigned int generation = CopyOnWrite::getGeneration();
+    if (generation == _activation) {
+      // Activated since the last fork (or there was none).
+      return false;
+    }
+    if (generation != _generation) {
+      startGeneration (generation);
+    }
+    return !_reallocatedBitmap.isSet (index);
+  }
+
+  /// @brief Records that the slot was handed out in this generation, so
+  ///        its page is (or soon will be) our own.
+  inline void markReallocated (int index) {
+    unsigned int generation = CopyOnWrite::getGeneration();
+    if (generation != _activation) {
+      if (generation != _generation) {
+	startGeneration (generation);
+      }
+      _reallocatedBitmap.tryToSet (index);
+    }
+  }
+
+  /// @brief After a fork, treats every slot as inherited again.
+  NO_INLINE void startGeneration (unsigned int generation) {
+    _reallocatedBitmap.clear();
+    _generation = generation;
+  }
+
   RandomMiniHeap& operator= (const RandomMiniHeap&);
 
   /// Sanity check.
@@ -225,13 +346,15 @@ private:
   /// @brief Checks to see if the predecessor and successor have been overflowed.
   void checkOverflowError (void * ptr, int index) const
   {
-    if ((index > 0) && (!_miniHeapBitmap.isSet (index - 1))) {
+    if ((index > 0) && (!_miniHeapBitmap.isSet (index - 1))
+	&& (!_unfilledBitmap.isSet (index - 1))) {
       void * p = (void *) (((ObjectStruct *) ptr) - 1);
       if (DieFast::checkNot (p, ObjectSize, _freedValue)) {
 	reportOverflowError();
       }
     }
-    if ((index < (NObjects - 1))  && (!_miniHeapBitmap.isSet (index + 1))) {
+    if ((index < (NObjects - 1))  && (!_miniHeapBitmap.isSet (index + 1))
+	&& (!_unfilledBitmap.isSet (index + 1))) {
       void * p = (void *) (((ObjectStruct *) ptr) + 1);
       if (DieFast::checkNot (p, ObjectSize, _freedValue)) {
 	reportOverflowError();
@@ -260,10 +383,17 @@ private:
   const size_t _freedValue;
 
   /// The bitmap for this heap.
-  BitMap<Allocator> _miniHeapBitmap;
+  BitMap<MiniHeapMetadataAllocator> _miniHeapBitmap;
 
-  /// A local random number generator.
-  RandomNumberGenerator _random;
+  /// With DieFast, marks free objects that were not filled (see CopyOnWrite).
+  BitMap<MiniHeapMetadataAllocator> _unfilledBitmap;
+
+  /// With DieFast, marks slots handed out since the last fork (see isInherited).
+  BitMap<MiniHeapMetadataAllocator> _reallocatedBitmap;
+
+  /// Without DieFast, marks objects that were ever handed out (and so
+  /// may not be zero); calloc needs to clear only those.
+  BitMap<MiniHeapMetadataAllocator> _dirtyBitmap;
 
   /// The heap pointer.
   char * _miniHeap;
@@ -271,6 +401,12 @@ private:
   /// How many objects are in use.
   size_t _inUse;
 
+  /// The fork generation (see CopyOnWrite) when this heap was activated.
+  unsigned int _activation;
+
+  /// The fork generation that _reallocatedBitmap describes.
+  unsigned int _generation;
+
   /// Sanity check value.
   const size_t _check2;
 
@@ -0,0 +1,91 @@
+// -*- C++ -*-
+
+/**
+ * @file   randomnumberbuffer.h
+ * @brief  Generates random numbers in batches, using several parallel lanes.
+ */
+
+#ifndef _RANDOMNUMBERBUFFER_H_
+#define _RANDOMNUMBERBUFFER_H_
+
+#include "platformspecific.h"
+#include "randomnumbergenerator.h"
+#include "realrandomvalue.h"
+#include "sassert.h"
+
+/**
+ * @class RandomNumberBuffer
+ * @brief A buffer of random words, refilled all at once.
+ * @param Size   the number of words generated per refill.
+ * @param Lanes  the number of independent generators run side by side.
+ *
+ * Each lane is a multiply-with-carry generator (see mwc.h) on 32-bit
+ * state. The lanes have no dependencies on each other, so the refill
+ * loop is vectorizable, and the allocation path only pays for a load
+ * (plus a rarely-taken branch) rather than for a serial chain of
+ * multiplies.
+ */
+
+template <int Size = 128,
+	  int Lanes = 4>
+class RandomNumberBuffer {
+public:
+
+  RandomNumberBuffer (void)
+  {
+    sassert<((Size % Lanes) == 0)> ensureLanesDivideSize;
+    reseed();
+  }
+
+  /// @brief Seeds every lane afresh, discarding any buffered values.
+  void reseed (void) {
+    // Derive each lane's seed from one scalar generator, so seeding
+    // costs the same as for a single RandomNumberGenerator.
+    RandomNumberGenerator seeder (RealRandomValue::value(),
+				  RealRandomValue::value());
+    for (int i = 0; i < Lanes; i++) {
+      _z[i] = nonzero ((unsigned int) seeder.next(), 362436069U);
+      _w[i] = nonzero ((unsigned int) seeder.next(), 521288629U);
+    }
+    _position = Size;
+  }
+
+  inline unsigned long next (void) {
+    if (_position == Size) {
+      refill();
+    }
+    return _buffer[_position++];
+  }
+
+private:
+
+  static inline unsigned int nonzero (unsigned int v, unsigned int dflt) {
+    // A zero seed makes a multiply-with-carry generator stick at zero.
+    return (v == 0) ? dflt : v;
+  }
+
+  NO_INLINE void refill (void) {
+    for (int i = 0; i < Size; i += Lanes) {
+      for (int j = 0; j < Lanes; j++) {
+	// These magic numbers are derived from a note by George Marsaglia.
+	_z[j] = 36969 * (_z[j] & 65535) + (_z[j] >> 16);
+	_w[j] = 18000 * (_w[j] & 65535) + (_w[j] >> 16);
+	_buffer[i + j] = (_z[j] << 16) + _w[j];
+      }
+    }
+    _position = 0;
+  }
+
+  /// The next unused word in the buffer.
+  int _position;
+
+  /// The per-lane generator state.
+  unsigned int _z[Lanes];
+  unsigned int _w[Lanes];
+
+  /// The generated random words.
+  unsigned int _buffer[Size];
+
+};
+
+#endif
@@ -12,11 +12,16 @@
 #define _REALRANDOMVALUE_H_
 
 #include <stdio.h>
+#include <stdlib.h>
+
+#include "heapconfig.h"
 
 #if defined(linux)
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/auxv.h>
 #include <fcntl.h>
 #endif
 
@@ -47,27 +52,81 @@ public:
   RealRandomValue (void)
   {}
 
+  /// @return a random value derived from the process-wide seed.
+  /// @note   Only the first call touches the operating system; every
+  ///         later value is expanded from the seed with splitmix64.
   static unsigned int value (void) {
+    // Atomic, since heaps may be built concurrently (e.g., per-CPU shards).
+    unsigned long long z = __sync_add_and_fetch (&getState(), 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (unsigned int) z;
+  }
+
+  /// @brief Mixes a fresh seed into the current state (e.g., in a forked child).
+  /// @note  With DIEHARD_SEED, the "fresh" seed is the fixed one, so
+  ///        children differ only because the parent's state advances
+  ///        before each fork (see wrapper.cpp).
+  static void reseed (void) {
+    unsigned long long fresh = initialSeed();
+    getState() ^= (fresh * 0xBF58476D1CE4E5B9ULL);
+    value();
+  }
+
+private:
+
+  static unsigned long long& getState (void) {
+    // NB: a guarded static, so threads building heaps at once still
+    // seed it exactly once (the guard neither allocates nor recurses).
+    static unsigned long long state = initialSeed();
+    return state;
+  }
+
+  /// @return the seed for this process, obtained with (at most) one system call.
+  static unsigned long long initialSeed (void) {
+    unsigned long long seed = 0;
+
+    // For reproducible runs, DIEHARD_SEED fixes the seed. This runs
+    // inside the first malloc and in a forked child, so read it as
+    // HeapConfig does: without getenv, and without allocating.
+    unsigned long fixed;
+    if (HeapConfig::parseNumber (HeapConfig::getVariable ("DIEHARD_SEED"), fixed)) {
+      return fixed;
+    }
+
 #if defined(_WIN32)
     // Use low-order values of the time function, with yields intermixed.
-    unsigned int v;
-    LARGE_INTEGER l1, l2, l3;
+    LARGE_INTEGER l1, l2;
     QueryPerformanceCounter(&l1);
     Sleep(0);
     QueryPerformanceCounter(&l2);
-    Sleep(0);
-    QueryPerformanceCounter(&l3);
-    v = l1.HighPart * l1.LowPart * l2.LowPart * l3.LowPart;
-    return v;
+    seed = ((unsigned long long) l1.HighPart << 32) ^ l1.LowPart ^ ((unsigned long long) l2.LowPart << 17);
+    return seed;
 #else
+#if defined(linux) && defined(SYS_getrandom)
+    // Don't block if the entropy pool is not ready yet; fall through instead.
+    if (syscall (SYS_getrandom, &seed, sizeof(seed), GETRANDOM_NONBLOCK) == (long) sizeof(seed)) {
+      return seed;
+    }
+#endif
+#if defined(linux) && defined(AT_RANDOM)
+    // The kernel hands every process 16 random bytes in the aux vector.
+    const unsigned long long * atRandom = (const unsigned long long *) getauxval (AT_RANDOM);
+    if (atRandom) {
+      return atRandom[0] ^ atRandom[1];
+    }
+#endif
     // Not really random...
-    unsigned int v;
     struct timeval tp;
     gettimeofday (&tp, NULL);
-    v = getpid() + tp.tv_usec + tp.tv_sec;
-    return v;
+    seed = ((unsigned long long) getpid() << 32) ^ ((unsigned long long) tp.tv_sec << 20) ^ tp.tv_usec;
+    return seed;
 #endif
   }
+
+  /// The getrandom flag asking for a failure instead of blocking (GRND_NONBLOCK).
+  enum { GETRANDOM_NONBLOCK = 1 };
 };
 
 #endif
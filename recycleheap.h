@@ -0,0 +1,79 @@
+// -*- C++ -*-
+
+/**
+ * @file   recycleheap.h
+ * @brief  Keeps freed power-of-two blocks for reuse, on top of a heap that cannot free.
+ */
+
+#ifndef _RECYCLEHEAP_H_
+#define _RECYCLEHEAP_H_
+
+#include <stdlib.h>
+
+/**
+ * @class RecycleHeap
+ * @brief Segregated free lists of power-of-two blocks.
+ * @param Super       the source of fresh memory (e.g., a BumpAlloc).
+ * @param NumClasses  the number of size classes (the largest is 2^(NumClasses-1)).
+ *
+ * Requests are rounded up to a power of two. Callers free blocks
+ * with freeSized, passing the size they asked for, so no header is
+ * needed. Memory is kept for reuse, not returned to Super.
+ */
+
+template <class Super, int NumClasses = 32>
+class RecycleHeap : public Super {
+public:
+
+  RecycleHeap (void)
+  {
+    for (int i = 0; i < NumClasses; i++) {
+      _freeList[i] = NULL;
+    }
+  }
+
+  inline void * malloc (size_t sz) {
+    int sizeClass = getSizeClass (sz);
+    if (sizeClass >= NumClasses) {
+      return NULL;
+    }
+    void * ptr = _freeList[sizeClass];
+    if (ptr != NULL) {
+      _freeList[sizeClass] = *((void **) ptr);
+      return ptr;
+    }
+    return Super::malloc (getClassSize (sizeClass));
+  }
+
+  /// @brief Puts a block (of the size it was requested with) up for reuse.
+  inline bool freeSized (void * ptr, size_t sz) {
+    if (ptr == NULL) {
+      return false;
+    }
+    int sizeClass = getSizeClass (sz);
+    *((void **) ptr) = _freeList[sizeClass];
+    _freeList[sizeClass] = ptr;
+    return true;
+  }
+
+private:
+
+  static inline size_t getClassSize (int sizeClass) {
+    return (size_t) 1 << sizeClass;
+  }
+
+  /// @return the smallest class that holds sz bytes (and a link).
+  static inline int getSizeClass (size_t sz) {
+    int sizeClass = 0;
+    while ((getClassSize (sizeClass) < sz) || (getClassSize (sizeClass) < sizeof(void *))) {
+      sizeClass++;
+    }
+    return sizeClass;
+  }
+
+  /// Freed blocks, by size class.
+  void * _freeList[NumClasses];
+
+};
+
+#endif
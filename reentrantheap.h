@@ -1,64 +1,235 @@
 #ifndef _REENTRANTHEAP_H_
 #define _REENTRANTHEAP_H_
 
+#include <string.h>
+
+#include "bootstrapheap.h"
+#include "platformspecific.h"
+
 /**
  * @class ReentrantHeap
- * @brief Allocates from a static buffer if the heap has not yet been initialized.
+ * @brief Allocates from a bootstrap arena when a thread re-enters the heap.
+ *
+ * Initialization (dlsym, TLS setup, etc.) can call back into malloc
+ * while this thread is already inside the heap. The guard is
+ * per-thread, so other threads (even ones waiting on a lock further
+ * down) always go to the real heap. Place this layer outside any
+ * locking layer, so a re-entrant call never tries to take a lock its
+ * own thread already holds.
  */
 
 template <class Super, int BufferSize = 65536>
 class ReentrantHeap : public Super {
 public:
-  ReentrantHeap (void)
-    : _inMalloc (false),
-      _bufferPosition (0),
-      _remaining (BufferSize)
-  {
-  }
 
   inline void * malloc (size_t sz) {
-    if (_inMalloc) {
-      return nextChunk (sz);
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      return _bootstrap.malloc (sz);
     } else {
-      _inMalloc = true;
+      inMalloc = true;
       void * ptr = Super::malloc (sz);
-      _inMalloc = false;
+      inMalloc = false;
       return ptr;
     }
   }
 
-  inline bool free (void * ptr) {
-    if (!_inMalloc) {
-      return Super::free (ptr);
+  inline void * calloc (size_t sz) {
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      // Bootstrap chunks are recycled, so they may not be zero.
+      void * ptr = _bootstrap.malloc (sz);
+      if (ptr != NULL) {
+	memset (ptr, 0, sz);
+      }
+      return ptr;
+    } else {
+      inMalloc = true;
+      void * ptr = Super::calloc (sz);
+      inMalloc = false;
+      return ptr;
+    }
+  }
+
+  template <int Index>
+  inline void * mallocClass (void) {
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      return _bootstrap.malloc (sizeof(double) << Index);
     } else {
+      inMalloc = true;
+      void * ptr = Super::template mallocClass<Index>();
+      inMalloc = false;
+      return ptr;
+    }
+  }
+
+  template <int Index>
+  inline bool freeClass (void * ptr) {
+    if (_bootstrap.contains (ptr)) {
+      _bootstrap.free (ptr);
       return true;
     }
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      return true;
+    }
+    inMalloc = true;
+    bool result = Super::template freeClass<Index> (ptr);
+    inMalloc = false;
+    return result;
   }
 
-private:
+  inline size_t mallocBatch (size_t sz, size_t n, void ** ptrs) {
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      size_t i;
+      for (i = 0; i < n; i++) {
+	ptrs[i] = _bootstrap.malloc (sz);
+	if (ptrs[i] == NULL) {
+	  break;
+	}
+      }
+      return i;
+    } else {
+      inMalloc = true;
+      size_t count = Super::mallocBatch (sz, n, ptrs);
+      inMalloc = false;
+      return count;
+    }
+  }
 
-  void * nextChunk (size_t sz) {
-    if (_remaining < sz) {
-      return NULL;
+  /// @return an aligned object (over-allocated from the bootstrap
+  ///         arena if re-entered), or NULL.
+  inline void * memalign (size_t alignment, size_t sz) {
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      if (sz > ~(size_t) 0 - alignment) {
+	return NULL;
+      }
+      // NB: the bootstrap arena frees interior pointers, so this is freed as usual.
+      char * buf = (char *) _bootstrap.malloc (alignment + sz);
+      if (buf == NULL) {
+	return NULL;
+      }
+      return (void *) (((size_t) buf + alignment - 1) & ~(alignment - 1));
     } else {
-      void * ptr = &_buffer[_bufferPosition];
-      _bufferPosition += sz;
-      _remaining -= sz;
+      inMalloc = true;
+      void * ptr = Super::memalign (alignment, sz);
+      inMalloc = false;
       return ptr;
     }
   }
 
-  /// True if we're in malloc.
-  bool _inMalloc;
+  inline bool free (void * ptr) {
+    if (_bootstrap.contains (ptr)) {
+      _bootstrap.free (ptr);
+      return true;
+    }
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      // We can't re-enter the real heap from inside itself; drop the
+      // free (leaking the object) rather than corrupt the heap.
+      return true;
+    }
+    inMalloc = true;
+    bool result = Super::free (ptr);
+    inMalloc = false;
+    return result;
+  }
+
+  inline bool freeSized (void * ptr, size_t sz) {
+    if (_bootstrap.contains (ptr)) {
+      _bootstrap.free (ptr);
+      return true;
+    }
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      return true;
+    }
+    inMalloc = true;
+    bool result = Super::freeSized (ptr, sz);
+    inMalloc = false;
+    return result;
+  }
+
+  inline bool freeBatch (size_t n, void ** ptrs) {
+    bool& inMalloc = getInMalloc();
+    bool mixed = inMalloc;
+    for (size_t i = 0; (i < n) && !mixed; i++) {
+      mixed = _bootstrap.contains (ptrs[i]);
+    }
+    if (mixed) {
+      // Rare: free them one at a time, as free would.
+      for (size_t i = 0; i < n; i++) {
+	if (ptrs[i] != NULL) {
+	  free (ptrs[i]);
+	}
+      }
+      return true;
+    }
+    inMalloc = true;
+    bool result = Super::freeBatch (n, ptrs);
+    inMalloc = false;
+    return result;
+  }
+
+  inline size_t getSize (void * ptr) {
+    if (_bootstrap.contains (ptr)) {
+      return _bootstrap.getSize (ptr);
+    }
+    return Super::getSize (ptr);
+  }
+
+  inline void * resize (void * ptr, size_t sz) {
+    if (_bootstrap.contains (ptr)) {
+      return (sz <= _bootstrap.getSize (ptr)) ? ptr : NULL;
+    }
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      return NULL;
+    }
+    inMalloc = true;
+    void * result = Super::resize (ptr, sz);
+    inMalloc = false;
+    return result;
+  }
+
+  inline bool resizeInPlace (void * ptr, size_t sz) {
+    if (_bootstrap.contains (ptr)) {
+      return (sz <= _bootstrap.getSize (ptr));
+    }
+    bool& inMalloc = getInMalloc();
+    if (inMalloc) {
+      return false;
+    }
+    inMalloc = true;
+    bool result = Super::resizeInPlace (ptr, sz);
+    inMalloc = false;
+    return result;
+  }
+
+  inline void lockAll (void) {
+    Super::lockAll();
+    _bootstrap.lock();
+  }
 
-  /// The static buffer for uninitialized allocations.
-  char _buffer[BufferSize];
+  inline void unlockAll (void) {
+    _bootstrap.unlock();
+    Super::unlockAll();
+  }
 
-  /// Position in the allocation buffer.
-  int _bufferPosition;
+private:
+
+  /// @return this thread's recursion flag.
+  static inline bool& getInMalloc (void) {
+    // Initial-exec TLS: reading it can never itself call malloc.
+    static INITIAL_EXEC_TLS bool inMalloc = false;
+    return inMalloc;
+  }
 
-  /// How much space remains in the buffer.
-  size_t _remaining;
+  /// The arena for re-entrant allocations.
+  BootstrapHeap<BufferSize> _bootstrap;
 };
 
 
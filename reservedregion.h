@@ -0,0 +1,166 @@
+// -*- C++ -*-
+
+/**
+ * @file   reservedregion.h
+ * @brief  Carves pieces, at random places, out of one reserved range of address space.
+ */
+
+#ifndef _RESERVEDREGION_H_
+#define _RESERVEDREGION_H_
+
+#include <stdlib.h>
+
+#include "diehard.h"
+#include "mmapwrapper.h"
+#include "numa.h"
+#include "platformspecific.h"
+#include "sassert.h"
+
+/**
+ * @class ReservedRegion
+ * @brief A large PROT_NONE reservation, committed a piece at a time.
+ * @param MaxPieces  the most pieces ever carved.
+ *
+ * Giving each size class one reservation keeps its mini heaps inside a
+ * single range, rather than scattered through the address space, and
+ * committing a piece (mprotect) needs no new mapping. The region is
+ * split into SLOTS equal slots, at least one per piece. Each piece
+ * goes in a free slot (or an aligned run of them, if it is bigger than
+ * a slot) picked at random, and at a random place within it aligned to
+ * its size, so mini heap addresses stay random and unpredictable from
+ * one another. The space between pieces stays inaccessible, so a
+ * stray access between mini heaps faults.
+ *
+ * The price is that committed pieces do not merge: the kernel keeps
+ * one mapping per piece, plus one per gap, so a size class uses at
+ * most 2 * MaxPieces + 1 mappings (against one per mini heap, and no
+ * gaps, for plain mmap).
+ *
+ * The reservation is made on first use. When it cannot be made (e.g.,
+ * on 32-bit systems, where address space is scarce) or has no room
+ * for a piece, carve returns NULL and the caller maps memory as before.
+ */
+
+template <int MaxPieces>
+class ReservedRegion {
+public:
+
+  /// The size of the reservation: 1GB on 64-bit systems, none otherwise.
+  enum { REGION_SHIFT = (sizeof(void *) == 8) ? 30 : 0 };
+
+  /// The number of slots the region is split into (one bit each in _used).
+  enum { SLOTS = 64 };
+
+  ReservedRegion (void)
+    : _base (NULL),
+      _failed (false),
+      _pieces (0),
+      _used (0)
+  {
+    sassert<(MaxPieces <= SLOTS)> ensureSlotPerPiece;
+  }
+
+  /// @return a fresh, untouched piece of sz bytes (a multiple of the page size), or NULL.
+  /// @param  rnd  a random value that picks the piece's position.
+  void * carve (size_t sz, unsigned long rnd) {
+    if ((REGION_SHIFT == 0) || (_pieces == MaxPieces)
+	|| (sz & (MmapWrapper::Size - 1)) || (sz == 0) || (sz > REGION_SIZE)) {
+      return NULL;
+    }
+    if (!reserve()) {
+      return NULL;
+    }
+    // The piece's footprint: a power of two, so that it can be aligned.
+    size_t span = MmapWrapper::Size;
+    while (span < sz) {
+      span <<= 1;
+    }
+    int slots = (span <= SLOT_SIZE) ? 1 : (int) (span / SLOT_SIZE);
+    unsigned long long mask = (slots == SLOTS)
+      ? ~0ULL
+      : ((1ULL << slots) - 1);
+    // Pick one of the free, aligned runs of slots at random.
+    int candidates = 0;
+    for (int i = 0; i < SLOTS; i += slots) {
+      if ((_used & (mask << i)) == 0) {
+	candidates++;
+      }
+    }
+    if (candidates == 0) {
+      return NULL;
+    }
+    int pick = (int) (rnd % (unsigned long) candidates);
+    rnd /= (unsigned long) candidates;
+    int slot = 0;
+    for (; ; slot += slots) {
+      if ((_used & (mask << slot)) == 0) {
+	if (pick == 0) {
+	  break;
+	}
+	pick--;
+      }
+    }
+    size_t offset = (size_t) slot * SLOT_SIZE;
+    if (span < SLOT_SIZE) {
+      // And a random place within the slot.
+      offset += (rnd % (SLOT_SIZE / span)) * span;
+    }
+    char * ptr = _base + offset;
+    if (!MmapWrapper::commit (ptr, sz)) {
+      return NULL;
+    }
+#if DIEHARD_NUMA
+    NUMA::bind (ptr, sz, NUMA::currentNode());
+#endif
+    _used |= (mask << slot);
+    _pieces++;
+    return ptr;
+  }
+
+  /// @return true iff ptr lies inside the reservation.
+  inline bool contains (void * ptr) const {
+    return (_base != NULL) && ((char *) ptr >= _base) && ((char *) ptr < _base + REGION_SIZE);
+  }
+
+  /// @brief Unmaps the whole reservation (every piece) at once.
+  void release (void) {
+    if (_base != NULL) {
+      MmapWrapper::unmap (_base, REGION_SIZE);
+    }
+    _base = NULL;
+    _failed = false;
+    _pieces = 0;
+    _used = 0;
+  }
+
+private:
+
+  static const size_t REGION_SIZE = (size_t) 1 << REGION_SHIFT;
+
+  // NB: 1 when there is no region, just to keep the arithmetic defined.
+  static const size_t SLOT_SIZE = (REGION_SIZE >= SLOTS) ? REGION_SIZE / SLOTS : 1;
+
+  /// @return true iff the region is reserved (reserving it if need be).
+  inline bool reserve (void) {
+    if ((_base == NULL) && !_failed) {
+      _base = (char *) MmapWrapper::reserve (REGION_SIZE);
+      _failed = (_base == NULL);
+    }
+    return (_base != NULL);
+  }
+
+  /// The start of the reservation (NULL until first use).
+  char * _base;
+
+  /// True iff we could not reserve the region.
+  bool _failed;
+
+  /// The number of pieces carved so far.
+  int _pieces;
+
+  /// The slots holding a piece, one bit each.
+  unsigned long long _used;
+
+};
+
+#endif
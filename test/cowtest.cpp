@@ -0,0 +1,97 @@
+// Checks that a forked child keeps its inherited heap pages shared.
+//
+// The parent fills the heap, then forks; the child frees everything
+// (as a worker tearing down inherited state would) and reports its
+// shared and private dirty memory from /proc/self/smaps. Build DieHard
+// with DIEHARD_DIEFAST=1 and DIEHARD_COW=1: the test fails if freeing
+// dirtied more than a small fraction of the inherited objects, or if
+// an object the child allocated itself is not filled when freed.
+// Pass --report to only print the numbers (e.g. for a build without
+// DIEHARD_COW, to compare).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+enum { NOBJECTS = 100000, OBJECT_SIZE = 64 };
+
+/// The most private dirty memory (in kB) freeing may add: an eighth of the objects.
+enum { MAX_DIRTIED_KB = NOBJECTS * OBJECT_SIZE / 1024 / 8 };
+
+static long report (const char * when)
+{
+  FILE * f = fopen ("/proc/self/smaps", "r");
+  if (f == NULL) {
+    perror ("/proc/self/smaps");
+    exit (1);
+  }
+  char line[256];
+  long sharedDirty = 0, privateDirty = 0;
+  long kb;
+  while (fgets (line, sizeof(line), f)) {
+    if (sscanf (line, "Shared_Dirty: %ld kB", &kb) == 1) {
+      sharedDirty += kb;
+    } else if (sscanf (line, "Private_Dirty: %ld kB", &kb) == 1) {
+      privateDirty += kb;
+    }
+  }
+  fclose (f);
+  printf ("%-24s shared dirty = %8ld kB, private dirty = %8ld kB\n",
+	  when, sharedDirty, privateDirty);
+  fflush (stdout);
+  return privateDirty;
+}
+
+/// @return true iff freeing an object the child allocated overwrote it (DieFast).
+static bool freedObjectIsFilled (void)
+{
+  unsigned char * ptr = (unsigned char *) malloc (OBJECT_SIZE);
+  memset (ptr, 0x5a, OBJECT_SIZE);
+  free (ptr);
+  // NB: reads a freed object, which DieHard leaves mapped.
+  for (int i = 0; i < OBJECT_SIZE; i++) {
+    if (ptr[i] != 0x5a) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main (int argc, char * argv[])
+{
+  bool check = !((argc > 1) && (strcmp (argv[1], "--report") == 0));
+
+  static char * objects[NOBJECTS];
+  for (int i = 0; i < NOBJECTS; i++) {
+    objects[i] = (char *) malloc (OBJECT_SIZE);
+    memset (objects[i], i, OBJECT_SIZE);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    long before = report ("child after fork:");
+    for (int i = 0; i < NOBJECTS; i++) {
+      free (objects[i]);
+    }
+    long after = report ("child after free:");
+    if (!check) {
+      _exit (0);
+    }
+    if (after - before > MAX_DIRTIED_KB) {
+      fprintf (stderr, "freeing dirtied %ld kB (limit %d kB)\n",
+	       after - before, (int) MAX_DIRTIED_KB);
+      _exit (1);
+    }
+    if (!freedObjectIsFilled()) {
+      fprintf (stderr, "an object allocated after fork was not filled when freed\n");
+      _exit (1);
+    }
+    _exit (0);
+  }
+
+  int status;
+  waitpid (pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,113 @@
+// Checks that MALLOCX_ZERO zeroes all of an object, and that xallocx
+// and rallocx resize in place when they can.
+//
+// Build with -I.. and link with DieHard; add -D'CUSTOM_PREFIX(n)=n' if
+// the library replaces malloc itself (see diehardapi.h). Slots are
+// dirtied first, so that zeroes must come from the heap, not from
+// fresh pages. Each check that fails is printed, and the test fails.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "diehardapi.h"
+
+#define mallocx  CUSTOM_PREFIX(mallocx)
+#define rallocx  CUSTOM_PREFIX(rallocx)
+#define xallocx  CUSTOM_PREFIX(xallocx)
+#define sallocx  CUSTOM_PREFIX(sallocx)
+#define dallocx  CUSTOM_PREFIX(dallocx)
+
+enum { NOBJECTS = 1000 };
+
+static int failures = 0;
+
+#define CHECK(cond)							\
+  do {									\
+    if (!(cond)) {							\
+      fprintf (stderr, "line %d: %s\n", __LINE__, #cond);		\
+      failures++;							\
+    }									\
+  } while (0)
+
+/// @return true iff bytes [from, to) of ptr are all zero.
+static bool isZero (void * ptr, size_t from, size_t to)
+{
+  for (size_t i = from; i < to; i++) {
+    if (((char *) ptr)[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// @brief Fills many objects of this size to the end of their slots, then frees them.
+static void dirty (size_t size, int flags)
+{
+  static void * objects[NOBJECTS];
+  for (int i = 0; i < NOBJECTS; i++) {
+    objects[i] = mallocx (size, flags);
+    memset (objects[i], 0xff, sallocx (objects[i], 0));
+  }
+  for (int i = 0; i < NOBJECTS; i++) {
+    dallocx (objects[i], flags);
+  }
+}
+
+int main()
+{
+  // The whole slot is zero, not just the bytes asked for.
+  dirty (10, 0);
+  for (int i = 0; i < NOBJECTS; i++) {
+    char * p = (char *) mallocx (10, MALLOCX_ZERO);
+    CHECK (isZero (p, 0, sallocx (p, 0)));
+    memset (p, 0xff, 10);
+    // Growing within the slot keeps the object where it is.
+    CHECK (xallocx (p, 16, 0, MALLOCX_ZERO) >= 16);
+    CHECK (isZero (p, 10, 16));
+    dallocx (p, 0);
+  }
+
+  // The same holds for aligned requests, which take another path.
+  dirty (3000, 0);
+  for (int i = 0; i < NOBJECTS; i++) {
+    char * p = (char *) mallocx (3000, MALLOCX_ZERO | MALLOCX_ALIGN (64));
+    CHECK (((size_t) p & 63) == 0);
+    CHECK (isZero (p, 0, sallocx (p, 0)));
+    dallocx (p, 0);
+  }
+
+  // rallocx in place: the contents stay, and the rest of the slot is zero.
+  dirty (100, 0);
+  for (int i = 0; i < NOBJECTS; i++) {
+    char * p = (char *) mallocx (100, MALLOCX_ZERO);
+    memset (p, 0x5a, 100);
+    char * q = (char *) rallocx (p, 120, MALLOCX_ZERO);
+    CHECK (q == p);
+    CHECK (q[99] == 0x5a);
+    CHECK (isZero (q, 100, sallocx (q, 0)));
+    // Moving to a larger class: the contents move, and the rest is zero.
+    char * r = (char *) rallocx (q, 1000, MALLOCX_ZERO);
+    CHECK ((r[0] == 0x5a) && (r[99] == 0x5a));
+    CHECK (isZero (r, 100, sallocx (r, 0)));
+    dallocx (r, 0);
+  }
+
+  // xallocx never moves an object, even when it cannot grow it.
+  char * p = (char *) mallocx (100, 0);
+  size_t size = sallocx (p, 0);
+  CHECK (xallocx (p, 1000, 0, 0) == size);
+  CHECK (sallocx (p, 0) == size);
+  dallocx (p, 0);
+
+  // A large object grows (when the pages after it are free) with zeroes.
+  p = (char *) mallocx (1 << 20, MALLOCX_ZERO);
+  CHECK (isZero (p, 0, sallocx (p, 0)));
+  memset (p, 0x5a, 1 << 20);
+  size = xallocx (p, (1 << 20) + 5000, 0, MALLOCX_ZERO);
+  CHECK (size >= (1 << 20));
+  CHECK (isZero (p, 1 << 20, size));
+  dallocx (p, 0);
+
+  printf ("%d failures\n", failures);
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,84 @@
+// Checks that heap memory carries a preferred-node NUMA policy.
+//
+// Build DieHard with DIEHARD_NUMA=1. Each thread allocates objects of
+// several sizes, then the test looks each one up in /proc/self/numa_maps
+// and fails if its mapping does not have the "prefer" policy that the
+// heap binds new memory with. Without numa_maps (no NUMA support in the
+// kernel), there is nothing to check and the test passes.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { NTHREADS = 4, NSIZES = 4 };
+
+static const size_t sizes[NSIZES] = { 16, 256, 4096, 32768 };
+
+static void * objects[NTHREADS][NSIZES];
+
+static void * worker (void * arg)
+{
+  void ** mine = (void **) arg;
+  for (int i = 0; i < NSIZES; i++) {
+    mine[i] = malloc (sizes[i]);
+    memset (mine[i], i, sizes[i]);
+  }
+  return NULL;
+}
+
+/// @return the policy of the mapping holding ptr (e.g., "default"), or "" if none.
+static const char * getPolicy (FILE * f, void * ptr, char * policy, size_t len)
+{
+  unsigned long addr = (unsigned long) ptr;
+  unsigned long best = 0;
+  char line[1024];
+  char name[64];
+  unsigned long start;
+  policy[0] = '\0';
+  rewind (f);
+  // Mappings are listed by start address; ptr is in the last one starting at or before it.
+  while (fgets (line, sizeof(line), f)) {
+    if ((sscanf (line, "%lx %63s", &start, name) == 2)
+	&& (start <= addr) && (start >= best)) {
+      best = start;
+      strncpy (policy, name, len - 1);
+      policy[len - 1] = '\0';
+    }
+  }
+  return policy;
+}
+
+int main()
+{
+  FILE * f = fopen ("/proc/self/numa_maps", "r");
+  if (f == NULL) {
+    printf ("no /proc/self/numa_maps: skipped\n");
+    return 0;
+  }
+
+  pthread_t threads[NTHREADS];
+  for (int i = 0; i < NTHREADS; i++) {
+    pthread_create (&threads[i], NULL, worker, objects[i]);
+  }
+  for (int i = 0; i < NTHREADS; i++) {
+    pthread_join (threads[i], NULL);
+  }
+
+  int failures = 0;
+  char policy[64];
+  for (int i = 0; i < NTHREADS; i++) {
+    for (int j = 0; j < NSIZES; j++) {
+      getPolicy (f, objects[i][j], policy, sizeof(policy));
+      if (strncmp (policy, "prefer", 6) != 0) {
+	fprintf (stderr, "%p (%lu bytes): policy \"%s\"\n",
+		 objects[i][j], (unsigned long) sizes[j], policy);
+	failures++;
+      }
+    }
+  }
+  fclose (f);
+  printf ("%d of %d objects without a preferred node\n",
+	  failures, NTHREADS * NSIZES);
+  return (failures == 0) ? 0 : 1;
+}
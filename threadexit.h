@@ -0,0 +1,106 @@
+// -*- C++ -*-
+
+/**
+ * @file   threadexit.h
+ * @brief  Runs heap clean-up hooks when a thread exits.
+ */
+
+#ifndef _THREADEXIT_H_
+#define _THREADEXIT_H_
+
+#include <stdlib.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+/**
+ * @class ThreadExit
+ * @brief A fixed-size table of hooks, run (via a pthread key destructor)
+ *        when a thread that asked for them exits.
+ *
+ * Heap layers that keep per-thread state call atThreadExit from the
+ * thread owning that state; nothing here allocates, so it is safe to
+ * call from inside malloc.
+ */
+
+class ThreadExit {
+public:
+
+  typedef void Hook (void);
+
+  /// @brief Runs hook when the calling thread exits (and also for
+  ///        every other thread that asks for any hook).
+  static void atThreadExit (Hook * hook) {
+#if !defined(_WIN32)
+    addHook (hook);
+    pthread_once (&getOnce(), createKey);
+    // Any non-NULL value makes the key's destructor run for this thread.
+    if (pthread_getspecific (getKey()) == NULL) {
+      pthread_setspecific (getKey(), (void *) 1);
+    }
+#endif
+  }
+
+private:
+
+  enum { MAX_HOOKS = 8 };
+
+#if !defined(_WIN32)
+
+  static void addHook (Hook * hook) {
+    while (__sync_lock_test_and_set (&getHookLock(), 1) != 0) {}
+    int n = getNumHooks();
+    bool found = false;
+    for (int i = 0; i < n; i++) {
+      found |= (getHooks()[i] == hook);
+    }
+    if (!found && (n < MAX_HOOKS)) {
+      getHooks()[n] = hook;
+      __sync_synchronize();
+      getNumHooks() = n + 1;
+    }
+    __sync_lock_release (&getHookLock());
+  }
+
+  static void runHooks (void *) {
+    int n = getNumHooks();
+    for (int i = 0; i < n; i++) {
+      (*getHooks()[i])();
+    }
+  }
+
+  static void createKey (void) {
+    pthread_key_create (&getKey(), runHooks);
+  }
+
+  static pthread_once_t& getOnce (void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    return once;
+  }
+
+  static pthread_key_t& getKey (void) {
+    static pthread_key_t key;
+    return key;
+  }
+
+  static volatile int& getNumHooks (void) {
+    static volatile int numHooks = 0;
+    return numHooks;
+  }
+
+  static Hook ** getHooks (void) {
+    static Hook * hooks[MAX_HOOKS];
+    return hooks;
+  }
+
+  static volatile long& getHookLock (void) {
+    static volatile long hookLock = 0;
+    return hookLock;
+  }
+
+#endif
+
+};
+
+#endif
@@ -7,12 +7,22 @@
  * @note   Copyright (C) 2005-2006 by Emery Berger, University of Massachusetts Amherst.
  */
 
+#include <assert.h>
 #include <string.h> // for memcpy
 #include <errno.h>
 
+#if !defined(_WIN32)
+#include <unistd.h> // for sysconf
+#endif
+
+// Before diehardapi.h, which declares its entry points with this prefix.
 #define CUSTOM_PREFIX(n) DieHard_##n
 //#define CUSTOM_PREFIX(n) n
 
+#include "backgroundunmapper.h"
+#include "diehardapi.h"
+#include "heapinstance.h"
+
 #define CUSTOM_MALLOC(x)     CUSTOM_PREFIX(malloc)(x)
 #define CUSTOM_FREE(x)       CUSTOM_PREFIX(free)(x)
 #define CUSTOM_REALLOC(x,y)  CUSTOM_PREFIX(realloc)(x,y)
@@ -20,6 +30,7 @@
 #define CUSTOM_MEMALIGN(x,y) CUSTOM_PREFIX(memalign)(x,y)
 #define CUSTOM_GETSIZE(x)    CUSTOM_PREFIX(malloc_usable_size)(x)
 #define CUSTOM_MALLOPT(x,y)  CUSTOM_PREFIX(mallopt)(x,y)
+#define CUSTOM_ALIGNED_ALLOC(x,y) CUSTOM_PREFIX(aligned_alloc)(x,y)
 #define CUSTOM_VALLOC(x)     CUSTOM_PREFIX(valloc)(x)
 #define CUSTOM_PVALLOC(x)    CUSTOM_PREFIX(pvalloc)(x)
 
@@ -34,13 +45,16 @@ extern "C" void * CUSTOM_MALLOC (size_t sz)
 extern "C" void * CUSTOM_CALLOC (size_t nelem, size_t elsize)
 {
   size_t n = nelem * elsize;
+  if ((elsize != 0) && (n / elsize != nelem)) {
+    // Overflow.
+    errno = ENOMEM;
+    return NULL;
+  }
   if (n == 0) {
     n = 1;
   }
-  void * ptr = getCustomHeap()->malloc (n);
-  if (ptr) {
-    memset (ptr, 0, n);
-  }
+  // The heap zeroes only memory that may not already be zero.
+  void * ptr = getCustomHeap()->calloc (n);
   return ptr;
 }
 
@@ -52,8 +66,41 @@ extern "C" void * CUSTOM_MEMALIGN (size_t alignment, size_t size)
     {
       return NULL;
     }
-  void * buf = CUSTOM_MALLOC (2 * alignment + size);
-  return (void *) (((size_t) buf + alignment - 1) & ~(alignment - 1));
+  if (alignment <= sizeof(double)) {
+    // Every object is at least this aligned.
+    return CUSTOM_MALLOC (size);
+  }
+  if (size > ~(size_t) 0 - alignment) {
+    // No aligned object this big can exist.
+    errno = ENOMEM;
+    return NULL;
+  }
+  // Small requests go to a size class whose objects are aligned;
+  // big ones get an aligned mapping.
+  void * ptr = getCustomHeap()->memalign (alignment, size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  assert (((size_t) ptr & (alignment - 1)) == 0);
+  return ptr;
+}
+
+// C11. (Unlike C11, we do not insist that size be a multiple of alignment.)
+extern "C" void * CUSTOM_ALIGNED_ALLOC (size_t alignment, size_t size)
+{
+  return CUSTOM_MEMALIGN (alignment, size);
+}
+
+/// @return the system's page size.
+static inline size_t getPageSize (void)
+{
+#if defined(_WIN32)
+  return MmapWrapper::Size;
+#else
+  static size_t pageSize = (size_t) sysconf (_SC_PAGESIZE);
+  return pageSize;
+#endif
 }
 
 
@@ -71,6 +118,25 @@ extern "C" void CUSTOM_FREE (void * ptr)
   // FIX ME
   //  memset (ptr, 0, CUSTOM_GETSIZE(ptr));
   getCustomHeap()->free (ptr);
+#if DIEHARD_BACKGROUND_UNMAP
+  // Only now, with no heap lock held (see BackgroundUnmapper).
+  BackgroundUnmapper::startIfWanted();
+#endif
+}
+
+
+// C23: the size (and alignment) must be those the object was
+// allocated with, which lets us skip searching for its size class.
+
+extern "C" void CUSTOM_PREFIX(free_sized) (void * ptr, size_t size)
+{
+  getCustomHeap()->freeSized (ptr, size);
+}
+
+extern "C" void CUSTOM_PREFIX(free_aligned_sized) (void * ptr, size_t alignment, size_t size)
+{
+  // memalign took the object from the class for the larger of the two.
+  getCustomHeap()->freeSized (ptr, (size < alignment) ? alignment : size);
 }
 
 
@@ -92,17 +158,31 @@ extern "C" void * CUSTOM_REALLOC (void * ptr, size_t sz)
     return NULL;
   }
 
+  // Avoid copying if the object still fits its slot, or (for a large
+  // object) if its pages can be trimmed or moved to a bigger mapping.
+  void * resized = getCustomHeap()->resize (ptr, sz);
+  if (resized != NULL) {
+#if DIEHARD_BACKGROUND_UNMAP
+    BackgroundUnmapper::startIfWanted();
+#endif
+    return resized;
+  }
+
   size_t objSize = CUSTOM_GETSIZE (ptr);
 
   void * buf = CUSTOM_MALLOC ((size_t) (sz));
 
-  if (buf != NULL) {
-    // Copy the contents of the original object
-    // up to the size of the new block.
-    size_t minSize = (objSize < sz) ? objSize : sz;
-    memcpy (buf, ptr, minSize);
+  if (buf == NULL) {
+    // As C requires, leave the original object alone.
+    errno = ENOMEM;
+    return NULL;
   }
 
+  // Copy the contents of the original object
+  // up to the size of the new block.
+  size_t minSize = (objSize < sz) ? objSize : sz;
+  memcpy (buf, ptr, minSize);
+
   // Free the old block.
   CUSTOM_FREE (ptr);
 
@@ -173,7 +253,11 @@ void * operator new (size_t sz, const std::nothrow_t&) throw() {
   return CUSTOM_MALLOC(sz);
 } 
 
+#if __cplusplus >= 201103L
+void * operator new[] (size_t size)
+#else
 void * operator new[] (size_t size) throw(std::bad_alloc)
+#endif
 {
   return CUSTOM_MALLOC(size);
 }
@@ -188,9 +272,68 @@ void operator delete[] (void * ptr)
 }
 #endif
 
+#if defined(__cpp_sized_deallocation)
+// C++14 sized delete.
+void operator delete (void * ptr, size_t sz)
+{
+  CUSTOM_PREFIX(free_sized) (ptr, sz);
+}
+
+void operator delete[] (void * ptr, size_t sz)
+{
+  CUSTOM_PREFIX(free_sized) (ptr, sz);
+}
+#endif
+
+#if defined(__cpp_aligned_new)
+#include <new>
+
+// C++17 aligned new and delete.
+void * operator new (size_t sz, std::align_val_t alignment)
+{
+  return CUSTOM_MEMALIGN ((size_t) alignment, sz);
+}
+
+void * operator new (size_t sz, std::align_val_t alignment, const std::nothrow_t&) throw()
+{
+  return CUSTOM_MEMALIGN ((size_t) alignment, sz);
+}
+
+void * operator new[] (size_t sz, std::align_val_t alignment)
+{
+  return CUSTOM_MEMALIGN ((size_t) alignment, sz);
+}
+
+void * operator new[] (size_t sz, std::align_val_t alignment, const std::nothrow_t&) throw()
+{
+  return CUSTOM_MEMALIGN ((size_t) alignment, sz);
+}
+
+void operator delete (void * ptr, std::align_val_t)
+{
+  CUSTOM_FREE (ptr);
+}
+
+void operator delete[] (void * ptr, std::align_val_t)
+{
+  CUSTOM_FREE (ptr);
+}
+
+void operator delete (void * ptr, size_t sz, std::align_val_t alignment)
+{
+  CUSTOM_PREFIX(free_aligned_sized) (ptr, (size_t) alignment, sz);
+}
+
+void operator delete[] (void * ptr, size_t sz, std::align_val_t alignment)
+{
+  CUSTOM_PREFIX(free_aligned_sized) (ptr, (size_t) alignment, sz);
+}
+#endif
+
 #if !defined(_WIN32)
 #include <dlfcn.h>
 #include <limits.h>
+#include <pthread.h>
 
 #if !defined(RTLD_NEXT)
 #define RTLD_NEXT ((void *) -1)
@@ -213,9 +356,379 @@ extern "C"  char * CUSTOM_PREFIX(getcwd) (char * buf, size_t size)
   return (real_getcwd)(buf, size);
 }
 
+typedef int pthread_createFunction (pthread_t *, const pthread_attr_t *,
+				    void * (*) (void *), void *);
+
+// Switches the heap into multithreaded mode (locking) as soon as the
+// program creates its first thread, before that thread can run.
+extern "C" int CUSTOM_PREFIX(pthread_create) (pthread_t * thread,
+					      const pthread_attr_t * attr,
+					      void * (*startRoutine) (void *),
+					      void * arg)
+{
+  static pthread_createFunction * real_pthread_create
+    = (pthread_createFunction *) dlsym (RTLD_NEXT, "pthread_create");
+  anyThreadCreated = 1;
+  return (*real_pthread_create) (thread, attr, startRoutine, arg);
+}
+
 #endif
 
 
+/***** DieHard-specific functions *****/
+
+// Reports the heap lock's counters: how many times it was taken, how
+// many of those found it held, and the total time (in cycles) spent
+// waiting for it.
+extern "C" void diehard_lock_statistics (unsigned long long * acquisitions,
+					 unsigned long long * contended,
+					 unsigned long long * waitCycles)
+{
+  LockStatistics stats;
+  getCustomHeap()->getLockStatistics (stats);
+  if (acquisitions) {
+    *acquisitions = stats.acquisitions;
+  }
+  if (contended) {
+    *contended = stats.contended;
+  }
+  if (waitCycles) {
+    *waitCycles = stats.waitCycles;
+  }
+}
+
+// Allocates n objects of the given size, taking the heap lock and
+// finding the size class just once. Each object is still placed
+// independently at random. Returns how many were allocated (into
+// ptrs[0] onwards); fewer than n only if memory ran out.
+extern "C" size_t diehard_malloc_batch (size_t size, size_t n, void ** ptrs)
+{
+  return getCustomHeap()->mallocBatch (size, n, ptrs);
+}
+
+// Frees n objects (of any sizes; NULLs are skipped) under a single
+// acquisition of the heap lock.
+extern "C" void diehard_free_batch (size_t n, void ** ptrs)
+{
+  getCustomHeap()->freeBatch (n, ptrs);
+}
+
+// Heap instances have the same expansion factor (M = 4/3) as the
+// main heap; only DieFast is configurable.
+extern "C" diehard_heap_t * diehard_heap_create (const diehard_heap_config * config)
+{
+  bool dieFast = config ? (config->diefast != 0) : (DIEHARD_DIEFAST == 1);
+  HeapInstanceBase * h;
+  if (dieFast) {
+    h = HeapInstance<4, 3, true>::create();
+  } else {
+    h = HeapInstance<4, 3, false>::create();
+  }
+  if ((h != NULL) && !HeapInstances::add (h)) {
+    // Too many instances.
+    h->destroy();
+    h = NULL;
+  }
+  return (diehard_heap_t *) h;
+}
+
+extern "C" void * diehard_heap_malloc (diehard_heap_t * heap, size_t size)
+{
+  return ((HeapInstanceBase *) heap)->malloc (size);
+}
+
+extern "C" void diehard_heap_free (diehard_heap_t * heap, void * ptr)
+{
+  ((HeapInstanceBase *) heap)->free (ptr);
+#if DIEHARD_BACKGROUND_UNMAP
+  BackgroundUnmapper::startIfWanted();
+#endif
+}
+
+extern "C" void diehard_heap_destroy (diehard_heap_t * heap)
+{
+  if (heap == NULL) {
+    return;
+  }
+  HeapInstanceBase * h = (HeapInstanceBase *) heap;
+  HeapInstances::remove (h);
+  h->destroy();
+}
+
+extern "C" unsigned int diehard_heap_arena (diehard_heap_t * heap)
+{
+  return (unsigned int) ((HeapInstanceBase *) heap)->_index;
+}
+
+
+/***** jemalloc extended interface *****/
+
+// The fields of the flags argument (see diehardapi.h).
+enum { MALLOCX_LG_ALIGN_MASK = 0x3f,
+       MALLOCX_ARENA_SHIFT = 20 };
+
+/// @return the alignment requested by flags (1 if none).
+static inline size_t getAlignment (int flags)
+{
+  return (size_t) 1 << (flags & MALLOCX_LG_ALIGN_MASK);
+}
+
+/// @return true iff flags name a heap instance (valid or not).
+static inline bool hasArena (int flags)
+{
+  return (((unsigned int) flags >> MALLOCX_ARENA_SHIFT) != 0);
+}
+
+/// @return the heap instance named by flags, or NULL if there is none.
+static inline HeapInstanceBase * getArena (int flags)
+{
+  return HeapInstances::get ((int) ((unsigned int) flags >> MALLOCX_ARENA_SHIFT) - 1);
+}
+
+/// @brief Resizes an object in place, on the heap named by flags.
+static inline bool resizeInPlace (void * ptr, size_t size, int flags)
+{
+  if (hasArena (flags)) {
+    HeapInstanceBase * h = getArena (flags);
+    return (h != NULL) && h->resizeInPlace (ptr, size);
+  }
+  return getCustomHeap()->resizeInPlace (ptr, size);
+}
+
+extern "C" void * CUSTOM_PREFIX(mallocx) (size_t size, int flags)
+{
+  size_t alignment = getAlignment (flags);
+  bool zero = (flags & MALLOCX_ZERO) != 0;
+  void * ptr;
+  if (hasArena (flags)) {
+    HeapInstanceBase * h = getArena (flags);
+    if (h == NULL) {
+      return NULL;
+    }
+    if (alignment > sizeof(double)) {
+      ptr = h->memalign (alignment, size);
+    } else {
+      // calloc zeroes the whole slot, not just size bytes.
+      return zero ? h->calloc (size) : h->malloc (size);
+    }
+  } else {
+    if (alignment > sizeof(double)) {
+      ptr = CUSTOM_MEMALIGN (alignment, size);
+    } else {
+      return zero ? CUSTOM_CALLOC (1, size) : CUSTOM_MALLOC (size);
+    }
+  }
+  if (zero && (ptr != NULL)) {
+    // All of the object, as sallocx reports it, not just size bytes.
+    memset (ptr, 0, CUSTOM_GETSIZE (ptr));
+  }
+  return ptr;
+}
+
+extern "C" void CUSTOM_PREFIX(dallocx) (void * ptr, int flags)
+{
+  if (hasArena (flags)) {
+    HeapInstanceBase * h = getArena (flags);
+    if ((h != NULL) && (ptr != NULL)) {
+      h->free (ptr);
+    }
+  } else {
+    CUSTOM_FREE (ptr);
+  }
+}
+
+extern "C" void CUSTOM_PREFIX(sdallocx) (void * ptr, size_t size, int flags)
+{
+  if (hasArena (flags)) {
+    CUSTOM_PREFIX(dallocx) (ptr, flags);
+  } else if (getAlignment (flags) > sizeof(double)) {
+    CUSTOM_PREFIX(free_aligned_sized) (ptr, getAlignment (flags), size);
+  } else {
+    CUSTOM_PREFIX(free_sized) (ptr, size);
+  }
+}
+
+extern "C" size_t CUSTOM_PREFIX(sallocx) (const void * ptr, int)
+{
+  // Size lookups find objects from any heap instance.
+  return CUSTOM_GETSIZE ((void *) ptr);
+}
+
+extern "C" size_t CUSTOM_PREFIX(nallocx) (size_t size, int flags)
+{
+  // Ask the heap that would serve the request: an instance's size
+  // classes need not match the main heap's (see ConfiguredHeap).
+  if (hasArena (flags)) {
+    HeapInstanceBase * h = getArena (flags);
+    return (h == NULL) ? 0 : h->roundSize (getAlignment (flags), size);
+  }
+  return getCustomHeap()->roundSize (getAlignment (flags), size);
+}
+
+// Resizes in place to at least size bytes (and to size + extra, if
+// possible); returns the resulting usable size.
+extern "C" size_t CUSTOM_PREFIX(xallocx) (void * ptr, size_t size, size_t extra, int flags)
+{
+  size_t oldSize = CUSTOM_GETSIZE (ptr);
+  size_t target = size + extra;
+  if (target < size) {
+    // Overflow: the extra is only a hint, so drop it.
+    target = size;
+  }
+  if (!resizeInPlace (ptr, target, flags) && (extra != 0)) {
+    resizeInPlace (ptr, size, flags);
+  }
+  size_t newSize = CUSTOM_GETSIZE (ptr);
+  if ((flags & MALLOCX_ZERO) && (newSize > oldSize)) {
+    memset ((char *) ptr + oldSize, 0, newSize - oldSize);
+  }
+  return newSize;
+}
+
+extern "C" void * CUSTOM_PREFIX(rallocx) (void * ptr, size_t size, int flags)
+{
+  size_t alignment = getAlignment (flags);
+  if (!hasArena (flags) && !(flags & MALLOCX_ZERO) && (alignment <= sizeof(double))) {
+    return CUSTOM_REALLOC (ptr, size);
+  }
+  size_t oldSize = CUSTOM_GETSIZE (ptr);
+  if ((((size_t) ptr & (alignment - 1)) == 0) && resizeInPlace (ptr, size, flags)) {
+    size_t newSize = CUSTOM_GETSIZE (ptr);
+    if ((flags & MALLOCX_ZERO) && (newSize > oldSize)) {
+      memset ((char *) ptr + oldSize, 0, newSize - oldSize);
+    }
+    return ptr;
+  }
+  void * newPtr = CUSTOM_PREFIX(mallocx) (size, flags);
+  if (newPtr == NULL) {
+    return NULL;
+  }
+  memcpy (newPtr, ptr, (oldSize < size) ? oldSize : size);
+  CUSTOM_PREFIX(dallocx) (ptr, flags);
+  return newPtr;
+}
+
+// Per-size-class entry points, for diehard::allocator (see diehardallocator.h).
+
+namespace diehard {
+
+  template <int Index>
+  void * mallocClass (void)
+  {
+    return getCustomHeap()->template mallocClass<Index>();
+  }
+
+  template <int Index>
+  void freeClass (void * ptr)
+  {
+    getCustomHeap()->template freeClass<Index> (ptr);
+  }
+
+}
+
+#define DIEHARD_INSTANTIATE_CLASS(i) \
+  template void * diehard::mallocClass<i> (void); \
+  template void diehard::freeClass<i> (void *);
+
+DIEHARD_INSTANTIATE_CLASS(0)
+DIEHARD_INSTANTIATE_CLASS(1)
+DIEHARD_INSTANTIATE_CLASS(2)
+DIEHARD_INSTANTIATE_CLASS(3)
+DIEHARD_INSTANTIATE_CLASS(4)
+DIEHARD_INSTANTIATE_CLASS(5)
+DIEHARD_INSTANTIATE_CLASS(6)
+DIEHARD_INSTANTIATE_CLASS(7)
+DIEHARD_INSTANTIATE_CLASS(8)
+DIEHARD_INSTANTIATE_CLASS(9)
+DIEHARD_INSTANTIATE_CLASS(10)
+DIEHARD_INSTANTIATE_CLASS(11)
+DIEHARD_INSTANTIATE_CLASS(12)
+DIEHARD_INSTANTIATE_CLASS(13)
+
+#undef DIEHARD_INSTANTIATE_CLASS
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// With DIEHARD_LOCK_STATS set, print the lock counters to stderr at exit.
+// Formats into a stack buffer and write()s it, so this never allocates.
+static void __attribute__((destructor)) diehardReportLockStatistics (void)
+{
+  if (getenv ("DIEHARD_LOCK_STATS") == NULL) {
+    return;
+  }
+  unsigned long long acquisitions, contended, waitCycles;
+  diehard_lock_statistics (&acquisitions, &contended, &waitCycles);
+  char buf[256];
+  int len = snprintf (buf, sizeof(buf),
+		      "DieHard lock: %llu acquisitions, %llu contended, %llu wait cycles\n",
+		      acquisitions, contended, waitCycles);
+  if (len > 0) {
+    write (2, buf, (len < (int) sizeof(buf)) ? len : (int) sizeof(buf) - 1);
+  }
+}
+#endif
+
+#if defined(__GNUC__) && !defined(_WIN32)
+
+// Fork safety: hold every heap lock across fork, so the child never
+// inherits a lock some other (now vanished) thread was holding. The
+// shared miniheap allocators' locks, and the background unmapper's, are
+// always taken after the heap locks, matching the order malloc itself
+// takes them.
+
+static void diehardPrepareFork (void)
+{
+  // Advance the parent's seed, so each child reseeds differently.
+  RealRandomValue::value();
+  getCustomHeap()->lockAll();
+  HeapInstances::lockAll();
+  MiniHeapAllocator::lockAll();
+  MiniHeapMetadataAllocator::lockAll();
+  if (DIEHARD_BACKGROUND_UNMAP) {
+    BackgroundUnmapper::lockAll();
+  }
+}
+
+static void diehardParentAfterFork (void)
+{
+  if (DIEHARD_BACKGROUND_UNMAP) {
+    BackgroundUnmapper::unlockAll();
+  }
+  MiniHeapMetadataAllocator::unlockAll();
+  MiniHeapAllocator::unlockAll();
+  HeapInstances::unlockAll();
+  getCustomHeap()->unlockAll();
+}
+
+static void diehardChildAfterFork (void)
+{
+  // Without this, parent and child would place objects identically.
+  RealRandomValue::reseed();
+  getCustomHeap()->reseed();
+  HeapInstances::reseed();
+  if (DIEHARD_COW) {
+    CopyOnWrite::forked();
+  }
+  if (DIEHARD_BACKGROUND_UNMAP) {
+    // Its thread did not survive the fork.
+    BackgroundUnmapper::resetInChild();
+  }
+  MiniHeapMetadataAllocator::unlockAll();
+  MiniHeapAllocator::unlockAll();
+  HeapInstances::unlockAll();
+  getCustomHeap()->unlockAll();
+}
+
+static void __attribute__((constructor)) diehardInstallForkHandlers (void)
+{
+  pthread_atfork (diehardPrepareFork, diehardParentAfterFork, diehardChildAfterFork);
+}
+
+#endif
+
 /***** replacement functions for GNU libc extensions to malloc *****/
 
 // A stub function to ensure that we capture mallopt.
@@ -229,8 +742,7 @@ extern "C" int CUSTOM_MALLOPT (int, int)
 extern "C" void * CUSTOM_VALLOC (size_t sz)
 {
   // Equivalent to memalign(pagesize, sz).
-  // For convenience, we assume pages are 8K.
-  void * ptr = CUSTOM_MEMALIGN (8192, sz);
+  void * ptr = CUSTOM_MEMALIGN (getPageSize(), sz);
   return ptr;
 }
 
@@ -238,7 +750,7 @@ extern "C" void * CUSTOM_VALLOC (size_t sz)
 extern "C" void * CUSTOM_PVALLOC (size_t sz)
 {
   // Rounds up to the next pagesize and then calls valloc.
-  sz = (sz + 8191) & ~8191;
+  sz = (sz + getPageSize() - 1) & ~(getPageSize() - 1);
   return CUSTOM_VALLOC(sz);
 }
 